@@ -3,6 +3,7 @@
 
 #include "ParallelPhysics.h"
 #include <iostream>
+#include <string>
 
 
 // Need to link with Ws2_32.lib
@@ -20,8 +21,118 @@ int main(int argc, char** argv)
 	size.m_posY = std::atoi(argv[2]);
 	size.m_posZ = std::atoi(argv[3]);
 
+	// optional parameters: name=value
+	PPh::ParallelPhysics::SimulationParams params;
+	for (int ii = 7; ii < argc; ++ii)
+	{
+		std::string arg = argv[ii];
+		size_t separator = arg.find('=');
+		std::string name = arg.substr(0, separator);
+		std::string value = separator == std::string::npos ? "" : arg.substr(separator + 1);
+		if (name == "engine" && value == "sweep")
+		{
+			params.m_engine = PPh::ParallelPhysics::SimulationEngine::BoxSweep;
+		}
+		else if (name == "engine" && value == "active")
+		{
+			params.m_engine = PPh::ParallelPhysics::SimulationEngine::ActivePhotons;
+		}
+		else if (name == "engine" && value == "gather")
+		{
+			params.m_engine = PPh::ParallelPhysics::SimulationEngine::Gather;
+		}
+		else if (name == "engine" && value == "stream")
+		{
+			params.m_engine = PPh::ParallelPhysics::SimulationEngine::Streaming;
+		}
+		else if (name == "largepages")
+		{
+			params.m_bLargePages = value == "1";
+		}
+		else if (name == "numa")
+		{
+			params.m_bNumaPlacement = value == "1";
+		}
+		else if (name == "seed")
+		{
+			params.m_randomSeed = std::strtoull(value.c_str(), nullptr, 10);
+		}
+		else if (name == "kernel" && value == "scalar")
+		{
+			params.m_photonKernel = PPh::PhotonKernel::KernelType::Scalar;
+		}
+		else if (name == "kernel" && value == "avx2")
+		{
+			params.m_photonKernel = PPh::PhotonKernel::KernelType::Avx2;
+		}
+		else if (name == "kernel" && value == "compare")
+		{
+			params.m_photonKernel = PPh::PhotonKernel::KernelType::Compare;
+		}
+		else if (name == "step" && value == "random")
+		{
+			params.m_photonStepMode = PPh::PhotonKernel::StepMode::Random;
+		}
+		else if (name == "step" && value == "table")
+		{
+			params.m_photonStepMode = PPh::PhotonKernel::StepMode::Table;
+		}
+		else if (name == "step" && value == "dda")
+		{
+			params.m_photonStepMode = PPh::PhotonKernel::StepMode::Dda;
+		}
+		else if (name == "checkstep")
+		{
+			params.m_bCheckStepMode = value == "1";
+		}
+		else if (name == "storage" && value == "slots")
+		{
+			params.m_photonStorage = PPh::ParallelPhysics::PhotonStorage::CellSlots;
+		}
+		else if (name == "storage" && value == "planes")
+		{
+			params.m_photonStorage = PPh::ParallelPhysics::PhotonStorage::DirectionPlanes;
+		}
+		else if (name == "buffer")
+		{
+			params.m_bSinglePhotonBuffer = value == "single";
+		}
+		else if (name == "jumps")
+		{
+			params.m_bPhotonJumps = value == "1";
+		}
+		else if (name == "culling")
+		{
+			params.m_bEnergyHorizonCulling = value == "1";
+		}
+		else if (name == "farfield")
+		{
+			params.m_farFieldPeriod = std::atoi(value.c_str());
+		}
+		else if (name == "echolocation")
+		{
+			params.m_bRayCastEcholocation = value == "raycast";
+		}
+		else if (name == "epoch")
+		{
+			params.m_epochTicks = std::atoi(value.c_str());
+		}
+		else if (name == "adaptive")
+		{
+			params.m_bAdaptiveThreads = value == "1";
+		}
+		else if (name == "affinity")
+		{
+			params.m_bPinThreads = value == "1";
+		}
+		else
+		{
+			printf("Unknown argument %s\n", arg.c_str());
+		}
+	}
+
 	printf("Initialization started.\n");
-	PPh::ParallelPhysics::Init(size, std::atoi(argv[5]), std::atoi(argv[6]));
+	PPh::ParallelPhysics::Init(size, std::atoi(argv[5]), std::atoi(argv[6]), params);
 	printf("Loading Universe...\n");
 	if (PPh::ParallelPhysics::LoadUniverse(argv[4]))
 	{
@@ -3,7 +3,7 @@
 #include "ParallelPhysics.h"
 #include <assert.h>
 #include <algorithm>
-#include <random>
+#include <math.h>
 
 namespace PPh
 {
@@ -54,11 +54,12 @@ void Observer::PPhTick(uint64_t universeTime)
 			msg.m_observerThreadTickTime = ParallelPhysics::GetTickTimeMusObserverThread();
 
 			const std::vector<uint32_t> &universeThreadsTimings = ParallelPhysics::GetTickTimeMusUniverseThreads();
-			if (universeThreadsTimings.size() > 0)
+			uint32_t activeThreadsCount = std::min<uint32_t>(ParallelPhysics::GetActiveUniverseThreadsCount(), (uint32_t)universeThreadsTimings.size());
+			if (activeThreadsCount > 0)
 			{
 				uint32_t timeMusMin = universeThreadsTimings[0];
 				uint32_t timeMusMax = universeThreadsTimings[0];
-				for (int32_t ii=1; ii < universeThreadsTimings.size(); ++ii)
+				for (int32_t ii=1; ii < activeThreadsCount; ++ii) // parked threads don't tick
 				{
 					timeMusMin = std::min(timeMusMin, universeThreadsTimings[ii]);
 					timeMusMax = std::max(timeMusMax, universeThreadsTimings[ii]);
@@ -66,7 +67,27 @@ void Observer::PPhTick(uint64_t universeTime)
 				msg.m_universeThreadMinTickTime = timeMusMin;
 				msg.m_universeThreadMaxTickTime = timeMusMax;
 			}
+			const std::vector<uint32_t> &barrierWaitTimings = ParallelPhysics::GetBarrierWaitMusThreads(); // observers thread is last
+			if (!barrierWaitTimings.empty())
+			{
+				msg.m_observerThreadBarrierWaitTime = barrierWaitTimings.back();
+				msg.m_universeThreadMinBarrierWaitTime = barrierWaitTimings[0];
+				msg.m_universeThreadMaxBarrierWaitTime = barrierWaitTimings[0];
+				for (int32_t ii=1; ii < activeThreadsCount; ++ii)
+				{
+					msg.m_universeThreadMinBarrierWaitTime = std::min(msg.m_universeThreadMinBarrierWaitTime, barrierWaitTimings[ii]);
+					msg.m_universeThreadMaxBarrierWaitTime = std::max(msg.m_universeThreadMaxBarrierWaitTime, barrierWaitTimings[ii]);
+				}
+			}
 			msg.m_universeThreadsCount = (uint16_t)universeThreadsTimings.size();
+			msg.m_activeUniverseThreadsCount = (uint16_t)activeThreadsCount;
+			msg.m_culledPhotonStepsPerSecond = ParallelPhysics::GetCulledPhotonStepsPerSecond();
+			const std::vector<uint16_t> &threadCpus = ParallelPhysics::GetThreadCpus(); // observers thread is last
+			msg.m_observerThreadCpu = threadCpus.empty() ? CommonParams::NOT_PINNED_CPU : threadCpus.back();
+			for (uint32_t ii = 0; ii < CommonParams::MAX_STATISTICS_UNIVERSE_THREADS; ++ii)
+			{
+				msg.m_universeThreadCpus[ii] = ii + 1 < threadCpus.size() ? threadCpus[ii] : CommonParams::NOT_PINNED_CPU;
+			}
 
 			int64_t timeDiff = universeTime - m_lastSendStatistics;
 			assert(timeDiff > 0);
@@ -92,21 +113,23 @@ void Observer::PPhTick(uint64_t universeTime)
 			++m_calledGetStateNumAfterLastSendStatistics;
 			for (uint32_t index = 0; index < 3 * 3 * 3 - 1; ++index)
 			{
+				EtherCellPhotonArray photons;
+				uint32_t photonsMask = 0;
 				if (IS_DAPHNIA_BIG)
 				{
-					EtherCellPhotonArray &photons = ParallelPhysics::GetReceivedPhotonsForBigDaphnia(this, index);
-					for (Photon &photon : photons)
-					{
-						HandleReceivedPhoton(photon);
-					}
+					photonsMask = ParallelPhysics::GrabReceivedPhotonsForBigDaphnia(this, index, photons);
 				}
 				else
 				{
-					EtherCellPhotonArray &photons = ParallelPhysics::GetReceivedPhotons(this);
-					for (Photon &photon : photons)
-					{
-						HandleReceivedPhoton(photon);
-					}
+					photonsMask = ParallelPhysics::GrabReceivedPhotons(this, photons);
+				}
+				while (photonsMask)
+				{
+					HandleReceivedPhoton(photons[CountTrailingZeros(photonsMask)]);
+					photonsMask &= photonsMask - 1;
+				}
+				if (!IS_DAPHNIA_BIG)
+				{
 					break;
 				}
 			}
@@ -192,10 +215,11 @@ void Observer::Echolocation()
 		rndVectorY[rr] = rr;
 	}
 
-	std::random_device rd;
-	std::mt19937 g(rd());
-	std::shuffle(rndVectorX.begin(), rndVectorX.end(), g);
-	std::shuffle(rndVectorY.begin(), rndVectorY.end(), g);
+	for (uint32_t rr = m_eyeSize - 1; rr > 0; --rr) // thread random stream keeps runs reproducible by seed
+	{
+		std::swap(rndVectorX[rr], rndVectorX[Rand32(rr + 1)]);
+		std::swap(rndVectorY[rr], rndVectorY[Rand32(rr + 1)]);
+	}
 
 	for (uint32_t xx = 0; xx < m_eyeSize; ++xx)
 	{
@@ -419,7 +443,7 @@ bool Observer::RotateDown(uint8_t value)
 	return false;
 }
 
-void Observer::HandleReceivedPhoton(Photon &photon)
+void Observer::HandleReceivedPhoton(const Photon &photon)
 {
 	if (photon.m_color.m_colorA > 0)
 	{
@@ -432,7 +456,6 @@ void Observer::HandleReceivedPhoton(Photon &photon)
 		msgSendPhoton.m_posX = posX;
 		msgSendPhoton.m_posY = posY;
 		ParallelPhysics::SendClientMsg(this, msgSendPhoton, sizeof(msgSendPhoton));
-		photon.m_color.m_colorA = 0;
 	}
 }
 
@@ -6,58 +6,102 @@
 #include "random"
 #include <chrono>
 #include "atomic"
+#include <string.h>
 
 namespace PPh
 {
 
-std::random_device rd;
-std::mt19937 e1(rd());
-int32_t Rand32(int32_t iRandMax) // from [0; iRandMax-1]
-{
-	std::uniform_int_distribution<int32_t> dist(0, iRandMax - 1);
-	return dist(e1);
-}
-
 // ---------------------------------------------------------------------------------
-// ------------------------------ VectorInt8Math -----------------------------------
-const VectorInt8Math VectorInt8Math::ZeroVector(0, 0, 0);
+// ------------------------------ RandomStream -------------------------------------
+std::atomic<uint64_t> s_randomSeed = std::random_device()();
+std::atomic<uint32_t> s_anonymousRandomStreams = 0;
+thread_local RandomStream t_randomStream;
 
-VectorInt8Math::VectorInt8Math(int8_t posX, int8_t posY, int8_t posZ) : VectorMath(posX, posY, posZ)
-{}
+RandomStream::RandomStream()
+{
+	Init(s_randomSeed, 0x80000000 | s_anonymousRandomStreams++);
+}
 
-std::vector<int8_t> s_randomUniverseNumbersInt8;
-std::atomic<uint8_t> s_randomIndexInt8 = 0;
+void RandomStream::Init(uint64_t seed, uint32_t streamId, uint64_t counter)
+{
+	m_seed = seed;
+	m_streamId = streamId;
+	m_counter = counter;
+	m_byteIndex = sizeof(m_buffer);
+}
 
-void VectorInt8Math::InitRandom()
+void RandomStream::FillBytes(uint8_t *outBytes, uint32_t count)
 {
-	uint32_t seed = (uint32_t)std::chrono::system_clock::now().time_since_epoch().count();
-	std::default_random_engine generator(seed);
-	if (s_randomUniverseNumbersInt8.empty())
+	while (count)
 	{
-		s_randomUniverseNumbersInt8.resize((PPH_INT_MAX + 1) * 2);
-		for (int ii = 0; ii < PPH_INT_MAX + 1; ++ii)
+		if (m_byteIndex >= sizeof(m_buffer))
 		{
-			s_randomUniverseNumbersInt8[ii] = ii;
+			Refill();
 		}
+		uint32_t chunk = std::min(count, (uint32_t)sizeof(m_buffer) - m_byteIndex);
+		memcpy(outBytes, reinterpret_cast<const uint8_t*>(m_buffer.data()) + m_byteIndex, chunk);
+		m_byteIndex += chunk;
+		outBytes += chunk;
+		count -= chunk;
 	}
+}
+
+__forceinline uint32_t MulHiLo(uint32_t a, uint32_t b, uint32_t &hi)
+{
+	uint64_t product = (uint64_t)a * b;
+	hi = (uint32_t)(product >> 32);
+	return (uint32_t)product;
+}
 
-	for (int8_t ii = PPH_INT_MAX; ii > 0; --ii)
+void RandomStream::Refill()
+{
+	constexpr uint32_t PHILOX_M0 = 0xD2511F53;
+	constexpr uint32_t PHILOX_M1 = 0xCD9E8D57;
+	constexpr uint32_t PHILOX_W0 = 0x9E3779B9;
+	constexpr uint32_t PHILOX_W1 = 0xBB67AE85;
+	for (uint32_t block = 0; block < m_buffer.size(); block += 4, ++m_counter)
 	{
-		// Pick a random index from 0 to i  
-		int8_t jj = Rand32(ii + 1);
-		std::swap(s_randomUniverseNumbersInt8[ii], s_randomUniverseNumbersInt8[jj]);
+		std::array<uint32_t, 4> ctr = { (uint32_t)m_counter, (uint32_t)(m_counter >> 32), m_streamId, 0 };
+		uint32_t key0 = (uint32_t)m_seed;
+		uint32_t key1 = (uint32_t)(m_seed >> 32);
+		for (int round = 0; round < 10; ++round)
+		{
+			uint32_t hi0, hi1;
+			uint32_t lo0 = MulHiLo(PHILOX_M0, ctr[0], hi0);
+			uint32_t lo1 = MulHiLo(PHILOX_M1, ctr[2], hi1);
+			ctr = { hi1 ^ ctr[1] ^ key0, lo1, hi0 ^ ctr[3] ^ key1, lo0 };
+			key0 += PHILOX_W0;
+			key1 += PHILOX_W1;
+		}
+		std::copy(ctr.begin(), ctr.end(), m_buffer.begin() + block);
 	}
+	m_byteIndex = 0;
+}
+
+void SetRandomSeed(uint64_t seed)
+{
+	s_randomSeed = seed;
+}
 
-	std::copy(s_randomUniverseNumbersInt8.begin(), s_randomUniverseNumbersInt8.begin() + PPH_INT_MAX + 1,
-		s_randomUniverseNumbersInt8.begin() + PPH_INT_MAX + 1);
+uint64_t GetRandomSeed()
+{
+	return s_randomSeed;
 }
 
-int8_t VectorInt8Math::GetRandomNumber()
+void InitThreadRandom(uint32_t streamId)
 {
-	return Rand32(PPH_INT_MAX + 1);
-	int8_t number = s_randomUniverseNumbersInt8[s_randomIndexInt8++];
-	return number;
+	t_randomStream.Init(s_randomSeed, streamId);
 }
+// ------------------------------ RandomStream -------------------------------------
+// ---------------------------------------------------------------------------------
+
+// ---------------------------------------------------------------------------------
+// ------------------------------ VectorInt8Math -----------------------------------
+const VectorInt8Math VectorInt8Math::ZeroVector(0, 0, 0);
+
+VectorInt8Math::VectorInt8Math(int8_t posX, int8_t posY, int8_t posZ) : VectorMath(posX, posY, posZ)
+{}
+
 // ------------------------------ VectorInt8Math -----------------------------------
 // ---------------------------------------------------------------------------------
 
@@ -68,38 +112,6 @@ const VectorInt16Math VectorInt16Math::ZeroVector(0, 0, 0);
 VectorInt16Math::VectorInt16Math(int16_t posX, int16_t posY, int16_t posZ) : VectorMath(posX, posY, posZ)
 {}
 
-std::vector<int16_t> s_randomUniverseNumbersInt16;
-std::atomic <uint16_t> s_randomIndexInt16 = 0;
-
-void VectorInt16Math::InitRandom()
-{
-	uint32_t seed = (uint32_t)std::chrono::system_clock::now().time_since_epoch().count();
-	std::default_random_engine generator(seed);
-	if (s_randomUniverseNumbersInt16.empty())
-	{
-		s_randomUniverseNumbersInt16.resize((PPH_INT_MAX + 1) * 2);
-		for (int ii = 0; ii < PPH_INT_MAX + 1; ++ii)
-		{
-			s_randomUniverseNumbersInt16[ii] = ii;
-		}
-	}
-
-	for (int16_t ii = PPH_INT_MAX; ii > 0; --ii)
-	{
-		// Pick a random index from 0 to i  
-		int16_t jj = Rand32(ii + 1);
-		std::swap(s_randomUniverseNumbersInt16[ii], s_randomUniverseNumbersInt16[jj]);
-	}
-
-	std::copy(s_randomUniverseNumbersInt16.begin(), s_randomUniverseNumbersInt16.begin() + PPH_INT_MAX + 1,
-		s_randomUniverseNumbersInt16.begin() + PPH_INT_MAX + 1);
-}
-
-int16_t VectorInt16Math::GetRandomNumber()
-{
-	int16_t number = s_randomUniverseNumbersInt16[s_randomIndexInt16++];
-	return number;
-}
 // ------------------------------ VectorInt8Math -----------------------------------
 // ---------------------------------------------------------------------------------
 
@@ -111,53 +123,6 @@ const VectorInt32Math VectorInt32Math::OneVector(1, 1, 1);
 VectorInt32Math::VectorInt32Math(int32_t posX, int32_t posY, int32_t posZ) : VectorMath(posX, posY, posZ)
 {}
 
-std::vector<int> s_randomUniverseNumbersInt32;
-std::atomic<int32_t> s_randomIndexInt32 = VectorInt32Math::PPH_INT_MAX;
-bool s_isRandomGeneratedInt32 = false;
-void VectorInt32Math::InitRandom()
-{
-	uint32_t seed = (uint32_t)std::chrono::system_clock::now().time_since_epoch().count();
-	std::default_random_engine generator(seed);
-	if (s_randomUniverseNumbersInt32.empty())
-	{
-		s_randomUniverseNumbersInt32.resize(PPH_INT_MAX);
-		for (int ii = 0; ii < PPH_INT_MAX; ++ii)
-		{
-			s_randomUniverseNumbersInt32[ii] = ii;
-		}
-	}
-}
-
-void GenerateNumbersStepByStep()
-{
-	static int32_t ii = VectorInt32Math::PPH_INT_MAX - 1;
-	// Pick a random index from 0 to i  
-	int32_t jj = Rand32(ii + 1);
-	std::swap(s_randomUniverseNumbersInt32[ii], s_randomUniverseNumbersInt32[jj]);
-	--ii;
-	if (0 >= ii)
-	{
-		s_isRandomGeneratedInt32 = true;
-	}
-}
-
-int32_t VectorInt32Math::GetRandomNumber()
-{
-	int32_t number = s_randomUniverseNumbersInt32[s_randomIndexInt32++]; // WARN! Multithreading problems
-	if (s_randomIndexInt32 > PPH_INT_MAX)
-	{
-		if (s_isRandomGeneratedInt32)
-		{
-			s_randomIndexInt32 = 0;
-		}
-		else
-		{
-			s_randomIndexInt32 = PPH_INT_MAX;
-			return Rand32(PPH_INT_MAX);
-		}
-	}
-	return number;
-}
 // ------------------------------ VectorInt32Math ----------------------------------
 // ---------------------------------------------------------------------------------
 
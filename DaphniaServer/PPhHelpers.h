@@ -1,11 +1,65 @@
 #pragma once
 
 #include <stdint.h>
+#include <intrin.h>
+#include <array>
 
 namespace PPh
 {
 	typedef class VectorInt8Math OrientationVectorMath;
 
+	// Counter-based random generator (Philox4x32-10). Sequence depends only on seed, stream id and counter,
+	// so every thread owns a stream and no state is shared between threads.
+	class RandomStream
+	{
+	public:
+		RandomStream(); // anonymous stream for threads which did not call InitThreadRandom
+		void Init(uint64_t seed, uint32_t streamId, uint64_t counter = 0); // counter splits stream to independent parts
+
+		__forceinline uint8_t NextByte()
+		{
+			if (m_byteIndex >= sizeof(m_buffer))
+			{
+				Refill();
+			}
+			return reinterpret_cast<const uint8_t*>(m_buffer.data())[m_byteIndex++];
+		}
+
+		__forceinline uint32_t Next32()
+		{
+			uint32_t index = (m_byteIndex + 3) / 4;
+			if (index >= m_buffer.size())
+			{
+				Refill();
+				index = 0;
+			}
+			m_byteIndex = (index + 1) * 4;
+			return m_buffer[index];
+		}
+
+		void FillBytes(uint8_t *outBytes, uint32_t count);
+
+	private:
+		void Refill(); // generates random bytes for several photons at once
+
+		std::array<uint32_t, 16> m_buffer; // 4 Philox blocks
+		uint32_t m_byteIndex = sizeof(m_buffer);
+		uint64_t m_counter = 0;
+		uint64_t m_seed = 0;
+		uint32_t m_streamId = 0;
+	};
+
+	extern thread_local RandomStream t_randomStream;
+
+	void SetRandomSeed(uint64_t seed); // affects streams initialized after the call
+	uint64_t GetRandomSeed();
+	void InitThreadRandom(uint32_t streamId); // restarts random sequence of current thread
+
+	__forceinline int32_t Rand32(int32_t iRandMax) // from [0; iRandMax-1]
+	{
+		return (int32_t)(((uint64_t)t_randomStream.Next32() * (uint32_t)iRandMax) >> 32);
+	}
+
 	template<class T, class D>
 	class VectorMath
 	{
@@ -54,8 +108,10 @@ namespace PPh
 		VectorInt8Math() = default;
 		VectorInt8Math(int8_t posX, int8_t posY, int8_t posZ);
 
-		static void InitRandom();
-		static int8_t GetRandomNumber(); // from 0 to PPH_INT_MAX
+		static __forceinline int8_t GetRandomNumber() // from 0 to PPH_INT_MAX
+		{
+			return t_randomStream.NextByte() & PPH_INT_MAX;
+		}
 	};
 
 	class VectorInt16Math : public VectorMath<int16_t, VectorInt16Math>
@@ -67,8 +123,10 @@ namespace PPh
 		VectorInt16Math() = default;
 		VectorInt16Math(int16_t posX, int16_t posY, int16_t posZ);
 
-		static void InitRandom();
-		static int16_t GetRandomNumber(); // from 0 to PPH_INT_MAX
+		static __forceinline int16_t GetRandomNumber() // from 0 to PPH_INT_MAX
+		{
+			return t_randomStream.Next32() & PPH_INT_MAX;
+		}
 	};
 
 	class VectorInt32Math : public VectorMath<int32_t, VectorInt32Math>
@@ -81,8 +139,10 @@ namespace PPh
 		VectorInt32Math() = default;
 		VectorInt32Math(int32_t posX, int32_t posY, int32_t posZ);
 
-		static void InitRandom();
-		static int32_t GetRandomNumber(); // from 0 to PPH_INT_MAX
+		static __forceinline int32_t GetRandomNumber() // from 0 to PPH_INT_MAX
+		{
+			return Rand32(PPH_INT_MAX + 1);
+		}
 	};
 
 	class VectorFloatMath : public VectorMath<float, VectorFloatMath>
@@ -139,23 +199,34 @@ namespace PPh
 	struct Photon
 	{
 		Photon() = default;
-		explicit Photon(const OrientationVectorMath &orientation) : m_orientation(orientation)
+		explicit Photon(const OrientationVectorMath &orientation) : m_orientation(orientation), m_stepPhase(0)
 		{}
 		EtherColor m_color;
 		OrientationVectorMath m_orientation;
 		PhotonParam m_param; // used to store coordinates of neuron which sent this photon
 		DaphniaIdType m_param2; // used to store daphnia id who sent this photon
+		uint8_t m_stepPhase; // steps made since emission from random start, selects shift in deterministic step modes (tail padding of struct)
 	};
 
 	int64_t GetTimeMs();
 
-	int32_t Rand32(int32_t iRandMax);
-
 	template<class T>
 	__forceinline int Sign(T x)
 	{
 		return (x > 0) - (x < 0);
 	}
 
+	__forceinline uint32_t CountTrailingZeros(uint32_t value) // value should not be zero
+	{
+		unsigned long index;
+		_BitScanForward(&index, value);
+		return index;
+	}
+
+	__forceinline uint32_t CountBits(uint32_t value)
+	{
+		return __popcnt(value);
+	}
+
 #define CHECK_BIT(var,pos) ((var) & (1<<(pos)))
 }
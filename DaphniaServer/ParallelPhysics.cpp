@@ -10,10 +10,14 @@
 #include "fstream"
 #include "atomic"
 #include "chrono"
+#include "mutex"
+#include "tuple"
 #include "AdminProtocol.h"
 #include "ServerProtocol.h"
 #include "AdminTcp.h"
 #include <assert.h>
+#include <string.h>
+#include <stddef.h>
 #include "Observer.h"
 
 #undef UNICODE
@@ -24,6 +28,9 @@
 #undef min
 #undef max
 
+// Need to link with Synchronization.lib for WaitOnAddress
+#pragma comment (lib, "Synchronization.lib")
+
 #pragma warning( disable : 4018)
 
 
@@ -35,16 +42,170 @@ namespace ParallelPhysics
 // ----------------------------------- Constants -------------------------------------
 // -----------------------------------------------------------------------------------
 uint32_t GetPhotonWeakening() { return 10 - (GetUniverseScale() - 1) * 2; }
+constexpr uint32_t MAX_SPECIALIZED_SCALE = 4; // tick kernels are compiled for every scale up to this, other scales use generic kernel
+template<uint32_t UNIVERSE_SCALE> // 0 is generic scale
+__forceinline uint32_t GetPhotonWeakening()
+{
+	if constexpr (UNIVERSE_SCALE == 0)
+	{
+		return GetPhotonWeakening();
+	}
+	else
+	{
+		static_assert(UNIVERSE_SCALE <= 5, "photon weakening should be positive");
+		return 10 - (UNIVERSE_SCALE - 1) * 2;
+	}
+}
 uint32_t GetSimulationSize() { return 8 + (GetUniverseScale() - 1) * 2; }
 
 // -----------------------------------------------------------------------------------
 // ----------------------------------- Variables -------------------------------------
 // -----------------------------------------------------------------------------------
 
-std::vector< std::vector< std::vector<struct EtherCell> > > s_universe;
+// Ether is split to bricks of ETHER_BRICK_SIZE^3 cells, cell [posX][posY][posZ] lives at GetCellIndex(pos).
+// Cells inside brick are in Morton (Z-order) so most of 26 neighbours are close in memory.
+// Geometry planes are always resident, photons are stored in bricks which are allocated on first photon and returned to pool when empty.
+constexpr int32_t ETHER_BRICK_SIZE_SHIFT = 3;
+constexpr int32_t ETHER_BRICK_SIZE = 1 << ETHER_BRICK_SIZE_SHIFT;
+constexpr int32_t ETHER_BRICK_CELLS_SHIFT = ETHER_BRICK_SIZE_SHIFT * 3;
+constexpr int32_t ETHER_BRICK_CELLS = 1 << ETHER_BRICK_CELLS_SHIFT;
+constexpr uint64_t ETHER_BRICKS_RELEASE_PERIOD = 64; // quantums of time between searches of empty bricks
+constexpr size_t ETHER_BRICKS_CHUNK_SIZE = 2 * 1024 * 1024; // bricks are allocated from OS by chunks
+constexpr int32_t CELL_PHOTONS_COUNT = std::tuple_size<EtherCellPhotonArray>::value;
+
+// Photons follow EtherBrick in memory, s_etherBrickSize bytes per brick. Layout is chosen by s_photonStorage, use GetEtherPhoton:
+// PhotonStorage::CellSlots: [index in brick][photon buffer][slot]
+// PhotonStorage::DirectionPlanes: [photon buffer][slot][linear index of cell in brick], see GetLinearIndexInBrick
+// Photon buffer is quantum of time parity, or 0 when both parities share slots (s_photonBuffersCount == 1)
+struct alignas(64) EtherBrick
+{
+	std::array<std::array<std::atomic<uint32_t>, ETHER_BRICK_CELLS>, 2> m_photonMasks; // bit per EtherCellPhotonArray slot that holds a photon, per quantum of time parity
+	std::atomic<uint64_t> m_lastEmitTime; // last quantum of time when photon was emitted to brick
+	int32_t m_brickIndex;
+	uint32_t m_numaNode; // node of memory chunk, brick returns to pool of the node
+};
+
+std::atomic<uint8_t> *s_etherTypes = nullptr; // EtherType::EEtherType packed by 2 bits, 4 cells per byte
+uint8_t *s_etherColors = nullptr; // index in s_etherPalette
+uint8_t *s_emptyDistances = nullptr; // Chebyshev distance to nearest not Space cell up to EMPTY_DISTANCE_MAX, nullptr if photons don't jump
+std::atomic<EtherBrick*> *s_etherBricks = nullptr; // nullptr for bricks without photons
+std::vector<EtherBrick*> s_residentBricks; // updated by simulation thread only
+std::vector< std::vector<EtherBrick*> > s_freeBricks; // pool for every NUMA node, protected by s_etherBricksMutex
+std::vector< std::pair<void*, size_t> > s_etherChunks; // memory got from OS, protected by s_etherBricksMutex
+std::mutex s_etherBricksMutex;
+bool s_bLargePages = false; // bricks chunks are allocated by large pages
+bool s_bNumaPlacement = false;
+size_t s_etherChunkSize = ETHER_BRICKS_CHUNK_SIZE;
+std::vector<uint32_t> s_threadNumaNodes; // NUMA node for every universe thread
+bool s_bPinThreads = false;
+std::vector<PROCESSOR_NUMBER> s_threadCpus; // logical processor for every universe thread and observers thread (last)
+PROCESSOR_NUMBER s_adminTcpCpu = {}; // first processor, serves network interrupts by default
+std::atomic<uint32_t> s_noPhotonsMask = 0; // mask for cells of not allocated bricks, only zero could be written
+std::array<EtherColor, 256> s_etherPalette; // all cell colors of the universe (crumbs, gray blocks, observers)
+std::atomic<uint32_t> s_etherPaletteSize = 0;
+VectorInt32Math s_bricksSize = VectorInt32Math::ZeroVector; // universe size in bricks
+int32_t s_bricksStrideX = 0; // brick index distance between neighbour bricks along X
+int32_t s_bricksStrideY = 0; // brick index distance between neighbour bricks along Y
+std::array<VectorInt32Math, ETHER_BRICK_CELLS> s_brickCellPositions; // position in brick for every Morton index in brick
+std::array<int16_t, ETHER_BRICK_CELLS> s_brickLinearIndices; // (x * ETHER_BRICK_SIZE + y) * ETHER_BRICK_SIZE + z for every Morton index in brick
+std::array<int16_t, ETHER_BRICK_CELLS> s_brickMortonIndices; // Morton index for every linear index in brick
+PhotonStorage s_photonStorage = PhotonStorage::CellSlots;
+int32_t s_photonBuffersCount = 2; // 1: photon of current quantum of time holds slot until it is stepped, photons for its slot are deferred
+size_t s_etherBrickSize = 0; // EtherBrick with its photons
+std::array<VectorInt32Math, 26> s_photonUnitVectors; // GetUnitVectorFromPhotonIndex for every photon index
 std::atomic<uint64_t> s_time = 0; // absolute universe time
-std::atomic<int32_t> s_waitThreadsCount = 0; // thread synchronization variable
-std::vector<BoxIntMath> s_threadSimulateBounds; // [minVector; maxVector)
+std::atomic<int32_t> s_waitThreadsCount = 0; // threads which didn't reach tick barrier, see WaitFor
+std::atomic<int32_t> s_firstPassThreadsCount = 0; // universe threads which finished first pass of tick: even tiles or scatter of Gather engines
+std::vector<BoxIntMath> s_threadSimulateBounds; // [minVector; maxVector), X slab of thread, Y and Z bound its boxes
+std::vector<BoxIntMath> s_simulateBoxes; // disjoint boxes simulated by all threads, whole universe or merged boxes of observers
+BoxIntMath s_simulateBoundingBox; // bounds s_simulateBoxes
+
+std::vector<uint8_t> s_threadByPosX; // universe thread which owns X slab in ActivePhotons engine
+thread_local int32_t t_threadIndex = 0; // universe thread number, observers thread is m_threadsCount
+
+struct alignas(64) ActiveCells // cells which got photons from one thread, separate cache lines for every thread
+{
+	std::array<std::vector<int32_t>, 2> m_cellIndices; // for quantum of time parity
+};
+std::vector< std::vector<ActiveCells> > s_activeCells; // [owner thread][emitter thread]
+std::vector<int32_t> s_vacatedCells; // cells left by observers, added to active cells at tick barrier
+
+struct alignas(64) AllocatedBricks // bricks allocated by one thread during quantum of time
+{
+	std::vector<EtherBrick*> m_bricks;
+};
+std::vector<AllocatedBricks> s_allocatedBricks; // [thread], universe threads and observers thread
+
+struct HaloPhoton // photon emitted to cell which other thread may emit to in the same quantum of time
+{
+	int32_t m_posX;
+	int32_t m_cellIndex;
+	int32_t m_cellPhotonIndex;
+	Photon m_photon;
+};
+struct alignas(64) HaloPhotons // merged to ether at tick barrier
+{
+	std::vector<HaloPhoton> m_photons;
+};
+std::vector<HaloPhotons> s_haloPhotons; // [thread], universe threads and observers thread
+std::vector<HaloPhoton> s_mergedHaloPhotons; // halo and landing photons of all threads sorted by destination, so merge doesn't depend on threads scheduling
+
+// Epoch: universe threads simulate s_epochTicks quantums of time between tick barriers. Every tile is stepped as trapezoid, which loses
+// a cell at both X sides per quantum of time, then cells around tile edges are stepped as inverted trapezoids. Observers see ether
+// and move once per epoch, photons which land in observer cells meanwhile wait in halo for tick barrier
+constexpr int32_t MAX_EPOCH_TICKS = 16;
+int32_t s_epochTicks = 1;
+
+// Simulated boxes are cut to X slices, tiles, which universe threads take in every pass of tick. Thread takes tiles of own slab first,
+// then steals tiles of other slabs. Tiles of one parity are not adjacent, photons from tiles of one pass never meet in a cell
+constexpr int32_t SIMULATION_TILES_PER_THREAD = 8;
+constexpr int32_t SIMULATION_TILE_MIN_SIZE = 2; // photon moves by one cell, so tile of other parity separates neighbour tiles
+constexpr int32_t SIMULATION_TILE_PASSES = 4; // pass takes tiles of parity pass % 2, Gather engines take all tiles twice, epochs take edges in pass 2
+struct SimulationTile
+{
+	std::vector<BoxIntMath> m_boxes; // simulated boxes clipped to X slice of tile
+	int32_t m_minX, m_maxX; // X slice of tile, [min; max)
+	std::array<std::vector<std::vector<HaloPhoton>>, 2> m_edgePhotons; // [left, right edge][quantum of time of epoch], photons which land around edge
+};
+std::vector<SimulationTile> s_simulationTiles;
+struct SimulationTileEdge // X where neighbour tiles meet or tile meets not simulated cells
+{
+	int32_t m_posX;
+	int32_t m_leftTile = -1; // indices in s_simulationTiles, -1 if there is no tile
+	int32_t m_rightTile = -1;
+};
+std::vector<SimulationTileEdge> s_simulationTileEdges;
+struct alignas(64) SimulationTileQueue // tiles of X slab of universe thread, separate cache lines for every thread
+{
+	std::array<std::vector<int32_t>, 2> m_tiles; // indices in s_simulationTiles for tile parity
+	std::vector<int32_t> m_edges; // indices in s_simulationTileEdges
+	std::array<std::atomic<int32_t>, SIMULATION_TILE_PASSES> m_nextTiles; // next tile or edge to take in pass, reset at tick barrier
+};
+std::unique_ptr<SimulationTileQueue[]> s_simulationTileQueues; // [thread]
+constexpr uint32_t TILE_RANDOM_STREAMS = 0x40000000; // random stream ids of tile items, below are universe threads, above are anonymous streams
+constexpr uint32_t FAR_SLAB_RANDOM_STREAMS = TILE_RANDOM_STREAMS | (SIMULATION_TILE_PASSES << 24); // far bounds of slab after tile passes
+
+// Photons far from geometry jump several cells at once and wait in timing wheel for quantum of time of landing.
+// Observers move by cell per quantum of time, so photon and observer can't meet while jump is shorter than half of distance
+constexpr int32_t EMPTY_DISTANCE_MAX = 15;
+constexpr int32_t PHOTON_JUMP_MIN = 2; // shorter jumps are stepped as usual
+constexpr int32_t PHOTON_JUMP_MAX = (EMPTY_DISTANCE_MAX - 2) / 2;
+constexpr uint32_t PHOTON_WHEEL_SIZE = 8;
+static_assert(PHOTON_WHEEL_SIZE > PHOTON_JUMP_MAX, "landing quantum of time should not wrap to current one");
+struct alignas(64) PhotonWheel
+{
+	std::array<std::vector<HaloPhoton>, PHOTON_WHEEL_SIZE> m_photons; // [quantum of time of landing % PHOTON_WHEEL_SIZE]
+};
+std::vector<PhotonWheel> s_photonWheels; // [thread], merged to ether at tick barrier like halo photons
+BoxIntMath s_emptyDistancesDirtyBox; // cells which changed type since last UpdateEmptyDistances
+
+// Far field: cells outside of near boxes are stepped once per s_farFieldPeriod quantums of time, every photon makes all steps
+// of period at once and waits in timing wheel. Photon which enters near box or observer cell on the way is handed over there
+uint32_t s_farFieldPeriod = 0; // 0 if cells outside of near boxes are not simulated
+std::vector<BoxIntMath> s_threadFarBounds; // [thread] X slabs of whole universe
+std::atomic<int32_t> s_farSteppedThreadsCount = 0; // universe threads which finished far field step
+thread_local int32_t t_directEmitMinX = 0; // [min; max) X of cells only current thread emits to in this quantum of time
+thread_local int32_t t_directEmitMaxX = 0; // empty for observers thread, it always emits to halo
 std::atomic<bool> s_bNeedUpdateSimulationBoxes;
 
 struct ObserverCell
@@ -55,47 +216,339 @@ struct ObserverCell
 	VectorInt32Math m_position; // universe position
 	SOCKET m_socket; // server socket for client
 	struct sockaddr_in m_clientAddr; // client ip address
+	std::array<EtherCellPhotonArray, CELL_PHOTONS_COUNT> m_echoPhotons; // ray-cast photons which reached body cell, [body cell photon index]
+	std::array<uint32_t, CELL_PHOTONS_COUNT> m_echoPhotonsMasks = {};
 };
 
 std::vector<ObserverCell> s_observers;
+bool s_bEnergyHorizonCulling = false;
+std::vector<VectorInt32Math> s_cullingObserverPositions; // positions of s_observers at tick barrier, read by universe threads
+struct alignas(64) CulledPhotonSteps // separate cache lines for every thread
+{
+	uint64_t m_count = 0;
+};
+std::vector<CulledPhotonSteps> s_culledPhotonSteps; // [thread]
+
+// Ray-cast echolocation: echolocation photon is marched through geometry at emission and waits in timing wheel
+// for quantum of time when it reaches body of its daphnia. Touched by observers thread only
+constexpr uint32_t ECHO_WHEEL_SIZE = 256;
+constexpr int32_t ECHO_MARCH_MAX_STEPS = ECHO_WHEEL_SIZE - 2; // arrival never wraps to current quantum of time, even without weakening
+bool s_bRayCastEcholocation = false;
+struct EchoPhoton
+{
+	uint8_t m_observerIndex;
+	uint8_t m_bodyCellIndex; // photon index of body cell relative to daphnia center, 0 for small daphnia
+	uint8_t m_cellPhotonIndex;
+	Photon m_photon;
+};
+std::array<std::vector<EchoPhoton>, ECHO_WHEEL_SIZE> s_echoPhotonsWheel; // [quantum of time of arrival % ECHO_WHEEL_SIZE]
 
 // stats
 uint32_t m_quantumOfTimePerSecond = 0;
+uint64_t m_culledPhotonStepsPerSecond = 0;
 #define HIGH_PRECISION_STATS 1
 std::vector<uint32_t> m_timingsUniverseThreads;
 std::vector<uint32_t> m_TickTimeMusAverageUniverseThreads;
 uint32_t m_timingsObserverThread;
 uint32_t m_TickTimeMusAverageObserverThread;
+struct alignas(64) BarrierWaitTime // separate cache lines for every thread
+{
+	uint64_t m_mus = 0;
+};
+std::vector<BarrierWaitTime> s_barrierWaitTimes; // [thread], universe threads and observers thread
+std::vector<uint32_t> m_barrierWaitMusAverage; // [thread], per quantum of time
 
 // vars
 VectorInt32Math m_universeSize = VectorInt32Math::ZeroVector;
 uint32_t m_universeScale = 1;
 uint8_t m_threadsCount = 1;
 bool m_bSimulateNearObserver = true;
+SimulationEngine m_simulationEngine = SimulationEngine::BoxSweep;
+PhotonKernel::StepMode m_photonStepMode = PhotonKernel::StepMode::Random;
 std::atomic<bool> m_isSimulationRunning = false;
 std::atomic<uint64_t> m_adminObserverId = 0;
 
-struct EtherCell
+// -----------------------------------------------------------------------------------
+// ---------------------------------- Tick barrier -----------------------------------
+// -----------------------------------------------------------------------------------
+// Threads reach tick barrier by decrement of s_waitThreadsCount, simulation thread waits for zero, merges their work and lets them go
+// by increment of s_time. Waiting thread spins for short ticks, then parks on address of value, so idle server doesn't burn cores
+constexpr uint32_t BARRIER_SPIN_COUNT = 1 << 12; // pauses before thread parks, few tens of microseconds
+constexpr DWORD BARRIER_PARK_TIMEOUT_MS = 100; // parked thread rechecks stop of simulation
+
+// Adaptive threads: simulation thread measures wall time of quantum of time for count of active universe threads and moves the count
+// to faster neighbour count, other universe threads are parked. Cost depends on simulated volume, so neighbours are measured again
+// from time to time and all counts after volume change. Thread 0 is simulation thread, it is always active
+constexpr uint64_t ADAPTIVE_THREADS_PERIOD = 256; // quantums of time between choices of count
+constexpr uint32_t ADAPTIVE_THREADS_PROBE_PERIODS = 16; // periods between measurements of neighbour count
+constexpr int64_t ADAPTIVE_THREADS_VOLUME_CHANGE = 4; // measurements are dropped when volume changes by this part
+bool s_bAdaptiveThreads = false;
+std::atomic<int32_t> s_activeThreadsCount = 0; // universe threads which take part in quantum of time, changed at tick barrier
+struct alignas(64) ParkedThread // separate cache lines for every thread
 {
-	EtherCell() = default;
-	explicit EtherCell(EtherType::EEtherType type) : m_type(type)
-	{}
-	int32_t m_type;
-	EtherColor m_color;
-	std::array <EtherCellPhotonArray, 2> m_photons;
+	std::atomic<uint64_t> m_unparkTime = 0; // quantum of time which parked thread joins
 };
+std::unique_ptr<ParkedThread[]> s_parkedThreads; // [thread]
+std::vector<uint64_t> s_activeThreadsTickNs; // [count] wall time of quantum of time, 0 if not measured
+int64_t s_activeThreadsVolume = 0; // simulated cells when counts were measured
+uint64_t s_activeThreadsPeriodTime = 0; // quantum of time when measurement period began
+std::chrono::high_resolution_clock::time_point s_activeThreadsPeriodBeginTime;
+uint32_t s_activeThreadsPeriodsCount = 0;
+
+// returns when isDone(value), time of wait is added to stats of current thread
+template<class T, class Condition>
+void WaitFor(std::atomic<T> &value, Condition isDone)
+{
+#ifdef HIGH_PRECISION_STATS
+	auto beginTime = std::chrono::high_resolution_clock::now();
+#endif
+	for (uint32_t spin = 0; ; ++spin)
+	{
+		T current = value.load(std::memory_order_acquire);
+		if (isDone(current))
+		{
+			break;
+		}
+		if (spin < BARRIER_SPIN_COUNT)
+		{
+			_mm_pause();
+		}
+		else
+		{
+			WaitOnAddress(&value, &current, sizeof(T), BARRIER_PARK_TIMEOUT_MS); // returns at once if value was changed
+		}
+	}
+#ifdef HIGH_PRECISION_STATS
+	auto endTime = std::chrono::high_resolution_clock::now();
+	s_barrierWaitTimes[t_threadIndex].m_mus += std::chrono::duration_cast<std::chrono::microseconds>(endTime - beginTime).count();
+#endif
+}
+
+// universe thread or observers thread finished quantum of time
+void ArriveAtTickBarrier()
+{
+	if (--s_waitThreadsCount == 0)
+	{
+		WakeByAddressAll(&s_waitThreadsCount);
+	}
+}
+
+void WaitNextQuantumOfTime(uint64_t time)
+{
+	WaitFor(s_time, [time](uint64_t curTime) { return curTime != time || !m_isSimulationRunning; }); // simulation thread doesn't start new tick after stop
+}
+
+// called by simulation thread when tick barrier is passed
+void StartNextQuantumOfTime()
+{
+	s_time += s_epochTicks;
+	WakeByAddressAll(&s_time);
+}
+
+// barrier inside of tick for active universe threads only, arrivedThreadsCount is reset at tick barrier
+void WaitAllUniverseThreads(std::atomic<int32_t> &arrivedThreadsCount)
+{
+	if (++arrivedThreadsCount == s_activeThreadsCount)
+	{
+		WakeByAddressAll(&arrivedThreadsCount);
+		return;
+	}
+	WaitFor(arrivedThreadsCount, [](int32_t count) { return count >= s_activeThreadsCount || !m_isSimulationRunning; }); // other threads don't start new tick after stop
+}
+
+// universe thread which is not active in quantum of time sleeps until simulation thread gives it later quantum of time to join.
+// Returns false if simulation is stopped
+bool ParkUniverseThread(int32_t threadNum, uint64_t time)
+{
+	std::atomic<uint64_t> &unparkTime = s_parkedThreads[threadNum].m_unparkTime;
+	for (uint64_t curUnparkTime = unparkTime; curUnparkTime <= time; curUnparkTime = unparkTime)
+	{
+		if (!m_isSimulationRunning)
+		{
+			return false;
+		}
+		WaitOnAddress(&unparkTime, &curUnparkTime, sizeof(curUnparkTime), BARRIER_PARK_TIMEOUT_MS);
+	}
+	return true;
+}
+
+// called by simulation thread after StartNextQuantumOfTime, threads from prevActiveThreadsCount join started quantum of time
+void UnparkUniverseThreads(int32_t prevActiveThreadsCount)
+{
+	for (int32_t ii = prevActiveThreadsCount; ii < s_activeThreadsCount; ++ii)
+	{
+		s_parkedThreads[ii].m_unparkTime.store(s_time);
+		WakeByAddressSingle(&s_parkedThreads[ii].m_unparkTime);
+	}
+}
+
+__forceinline int32_t GetBrickIndex(int32_t cellIndex)
+{
+	return cellIndex >> ETHER_BRICK_CELLS_SHIFT;
+}
+
+__forceinline bool IsPosInBox(const VectorInt32Math &pos, const BoxIntMath &box)
+{
+	return box.m_minVector.m_posX <= pos.m_posX && pos.m_posX < box.m_maxVector.m_posX &&
+		box.m_minVector.m_posY <= pos.m_posY && pos.m_posY < box.m_maxVector.m_posY &&
+		box.m_minVector.m_posZ <= pos.m_posZ && pos.m_posZ < box.m_maxVector.m_posZ;
+}
+
+__forceinline bool IsPosSimulated(const VectorInt32Math &pos) // pos is in one of s_simulateBoxes
+{
+	if (!IsPosInBox(pos, s_simulateBoundingBox))
+	{
+		return false;
+	}
+	if (s_simulateBoxes.size() == 1)
+	{
+		return true;
+	}
+	for (const BoxIntMath &box : s_simulateBoxes)
+	{
+		if (IsPosInBox(pos, box))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+__forceinline int32_t GetIndexInBrick(int32_t cellIndex)
+{
+	return cellIndex & (ETHER_BRICK_CELLS - 1);
+}
+
+// spread 3 low bits of value to every third bit: 0bcba -> 0bc00b00a
+__forceinline int32_t SpreadMortonBits(int32_t value)
+{
+	return (value & 1) | ((value & 2) << 2) | ((value & 4) << 4);
+}
+
+__forceinline int32_t GetCellIndex(const VectorInt32Math &pos)
+{
+	static_assert(ETHER_BRICK_SIZE_SHIFT == 3, "SpreadMortonBits handles 3 bits");
+	constexpr int32_t localMask = ETHER_BRICK_SIZE - 1;
+	int32_t brickIndex = (pos.m_posX >> ETHER_BRICK_SIZE_SHIFT) * s_bricksStrideX + (pos.m_posY >> ETHER_BRICK_SIZE_SHIFT) * s_bricksStrideY +
+		(pos.m_posZ >> ETHER_BRICK_SIZE_SHIFT);
+	int32_t indexInBrick = (SpreadMortonBits(pos.m_posX & localMask) << 2) | (SpreadMortonBits(pos.m_posY & localMask) << 1) |
+		SpreadMortonBits(pos.m_posZ & localMask);
+	return (brickIndex << ETHER_BRICK_CELLS_SHIFT) | indexInBrick;
+}
+
+__forceinline int32_t GetEtherType(int32_t cellIndex)
+{
+	return (s_etherTypes[cellIndex >> 2].load(std::memory_order_relaxed) >> ((cellIndex & 3) * 2)) & 3;
+}
+
+// byte is shared by 4 cells and read by universe threads meanwhile, so bits of one cell are replaced atomically
+__forceinline void SetEtherType(int32_t cellIndex, int32_t type)
+{
+	std::atomic<uint8_t> &packed = s_etherTypes[cellIndex >> 2];
+	int32_t shift = (cellIndex & 3) * 2;
+	uint8_t oldPacked = packed.load(std::memory_order_relaxed);
+	while (!packed.compare_exchange_weak(oldPacked, (uint8_t)((oldPacked & ~(3 << shift)) | (type << shift)), std::memory_order_relaxed))
+	{
+	}
+}
+
+__forceinline const EtherColor& GetEtherColor(int32_t cellIndex)
+{
+	return s_etherPalette[s_etherColors[cellIndex]];
+}
+
+__forceinline EtherBrick* GetEtherBrick(int32_t cellIndex)
+{
+	return s_etherBricks[GetBrickIndex(cellIndex)].load(std::memory_order_acquire);
+}
+
+__forceinline int32_t GetLinearIndexInBrick(int32_t indexInBrick)
+{
+	return s_brickLinearIndices[indexInBrick];
+}
+
+__forceinline int32_t GetPhotonBuffer(int32_t isTimeOdd)
+{
+	return isTimeOdd & (s_photonBuffersCount - 1);
+}
+
+__forceinline Photon& GetEtherPlanePhoton(EtherBrick *brick, int32_t isTimeOdd, int32_t slot, int32_t linearIndex)
+{
+	Photon *photons = reinterpret_cast<Photon*>(brick + 1);
+	return photons[(GetPhotonBuffer(isTimeOdd) * CELL_PHOTONS_COUNT + slot) * ETHER_BRICK_CELLS + linearIndex];
+}
+
+__forceinline Photon& GetEtherPhoton(EtherBrick *brick, int32_t indexInBrick, int32_t isTimeOdd, int32_t slot)
+{
+	if (s_photonStorage == PhotonStorage::DirectionPlanes)
+	{
+		return GetEtherPlanePhoton(brick, isTimeOdd, slot, GetLinearIndexInBrick(indexInBrick));
+	}
+	Photon *photons = reinterpret_cast<Photon*>(brick + 1);
+	return photons[(indexInBrick * s_photonBuffersCount + GetPhotonBuffer(isTimeOdd)) * CELL_PHOTONS_COUNT + slot];
+}
+
+// brick should be resident (photons mask of cell is not zero)
+__forceinline Photon& GetEtherPhoton(int32_t cellIndex, int32_t isTimeOdd, int32_t slot)
+{
+	return GetEtherPhoton(GetEtherBrick(cellIndex), GetIndexInBrick(cellIndex), isTimeOdd, slot);
+}
+
+// distance in Photons between neighbour slots of one cell
+__forceinline uint32_t GetEtherPhotonsStride()
+{
+	return s_photonStorage == PhotonStorage::DirectionPlanes ? ETHER_BRICK_CELLS : 1;
+}
+
+__forceinline std::atomic<uint32_t>& GetEtherPhotonsMask(int32_t cellIndex, int32_t isTimeOdd)
+{
+	EtherBrick *brick = GetEtherBrick(cellIndex);
+	return brick ? brick->m_photonMasks[isTimeOdd][GetIndexInBrick(cellIndex)] : s_noPhotonsMask;
+}
+
 // -----------------------------------------------------------------------------------
 // -------------------------------- Functions declaration ----------------------------
 // -----------------------------------------------------------------------------------
 bool InitEtherCell(const VectorInt32Math &pos, EtherType::EEtherType type, const EtherColor &color = EtherColor()); // returns true if success
+bool GetPaletteIndex(const EtherColor &color, uint8_t &outIndex); // adds color to s_etherPalette if needed, returns false if palette is full
+template<class T> T* AllocateEtherPlane(size_t count);
+void FreeEtherPlanes();
+void FirstTouchEtherPlanes(uint8_t spaceColorIndex);
+bool EnableLargePages(); // returns true if process got SeLockMemoryPrivilege
+void* AllocateEtherMemory(size_t size, uint32_t numaNode, bool bLargePages);
+void BindThreadToNumaNode(uint32_t numaNode);
+bool PlanThreadCpus(); // fills s_threadCpus by cache topology, returns false if topology is not available
+void PinThreadToCpu(HANDLE thread, const PROCESSOR_NUMBER &cpu);
+EtherBrick* AllocateEtherBrick(int32_t cellIndex); // returns nullptr if out of memory
+void ReleaseEmptyEtherBricks();
 uint32_t GetCellPhotonIndex(const VectorInt32Math &unitVector);
+uint32_t GrabEtherPhotons(int32_t cellIndex, EtherCellPhotonArray &outPhotons);
+VectorInt32Math GetCellPos(int32_t cellIndex);
+void AddActiveCell(int32_t posX, int32_t cellIndex, int32_t isTimeOdd);
+void ActivateVacatedCell(int32_t cellIndex);
+void ActivateVacatedCells(); // called at tick barrier
 VectorInt32Math GetUnitVectorFromPhotonIndex(uint32_t index); // index [0;25]
 void AdjustSimulationBoxes();
+void BuildSimulationTiles(); // called when simulated boxes or slabs of threads are changed
+void ResetSimulationTiles(); // called at tick barrier
+int32_t ChooseActiveThreadsCount(); // called at tick barrier, returns previous count
 void AdjustSizeByBounds(VectorInt32Math &size);
 const VectorInt32Math& GetUniverseSize();
 bool IsPosInBounds(const VectorInt32Math &pos);
 VectorInt32Math GetRandomEmptyCell();
 bool EmitPhoton(const VectorInt32Math &pos, const struct Photon &photon);
+template<SimulationEngine ENGINE, int32_t IS_NEXT_TIME_ODD>
+bool EmitPhoton(const VectorInt32Math &pos, const struct Photon &photon, const VectorInt32Math &unitVector, int32_t cellPhotonIndex, uint64_t emitTime);
+template<SimulationEngine ENGINE, int32_t IS_NEXT_TIME_ODD, bool IS_MERGE = false>
+bool WriteEtherPhoton(int32_t posX, int32_t cellIndex, int32_t cellPhotonIndex, const struct Photon &photon, uint64_t emitTime);
+void MergeHaloPhotons();
+void SelectUniverseTicks();
+void InvalidateEmptyDistances(const VectorInt32Math &pos); // type of cell was changed
+void UpdateCullingObserverPositions(); // called at tick barrier
+void UpdateEmptyDistances(); // called at tick barrier
+bool RayCastEcholocationPhoton(uint8_t observerIndex, const VectorInt32Math &pos, Photon photon);
+void DeliverEchoPhotons(); // called by observers thread before observers tick
+uint32_t GrabEchoPhotons(uint8_t observerIndex, uint32_t bodyCellIndex, EtherCellPhotonArray &outPhotons, uint32_t etherPhotonsMask);
 //void ClearReceivedPhotons(const class Observer *observer);
 VectorInt32Math DestroyCrumb(VectorInt32Math cellPos, bool isResetMinCellPos);
 bool CanDaphniaMoveToNextCell(const VectorInt32Math &pos);
@@ -106,38 +559,104 @@ void MoveDaphniaToNextCell(const VectorInt32Math &pos, const VectorInt32Math &un
 // -----------------------------------------------------------------------------------
 VectorInt32Math CalculatePositionShift(const VectorInt32Math &pos, const OrientationVectorMath &orient);
 
-bool Init(const VectorInt32Math &universeSize, uint8_t threadsCount, uint32_t universeScale)
+bool Init(const VectorInt32Math &universeSize, uint8_t threadsCount, uint32_t universeScale, const SimulationParams &params)
 {
 	m_universeSize = universeSize;
 	m_universeSize *= universeScale;
 	m_universeScale = universeScale;
+	m_simulationEngine = params.m_engine;
+	m_photonStepMode = params.m_photonStepMode;
+	m_bSimulateNearObserver = m_simulationEngine != SimulationEngine::ActivePhotons;
+	s_bEnergyHorizonCulling = params.m_bEnergyHorizonCulling;
+	s_bRayCastEcholocation = params.m_bRayCastEcholocation;
 	if (0 < m_universeSize.m_posX && 0 < m_universeSize.m_posY && 0 < m_universeSize.m_posZ)
 	{
-		OrientationVectorMath::InitRandom();
-		s_universe.resize(m_universeSize.m_posX);
-		for (auto &itY : s_universe)
+		if (params.m_randomSeed)
+		{
+			SetRandomSeed(params.m_randomSeed);
+		}
+		printf("Random seed: %llu\n", (unsigned long long)GetRandomSeed());
+		InitThreadRandom(0); // simulation thread is universe thread 0
+		if (!PhotonKernel::Init(params.m_photonKernel))
+		{
+			printf("Photon kernel is not supported by CPU\n");
+		}
+		printf("Photon kernel: %s\n", PhotonKernel::GetKernelName());
+		printf("Photon step mode: %s\n", PhotonKernel::GetStepModeName(m_photonStepMode));
+		if (params.m_bCheckStepMode && m_photonStepMode != PhotonKernel::StepMode::Random && !PhotonKernel::CheckStepMode(m_photonStepMode))
+		{
+			printf("Photon step mode doesn't match random stepping\n");
+		}
+		s_photonStorage = m_simulationEngine == SimulationEngine::Streaming ? PhotonStorage::DirectionPlanes : params.m_photonStorage;
+		s_photonBuffersCount = params.m_bSinglePhotonBuffer ? 1 : 2;
+		if (s_photonBuffersCount == 1 && (m_simulationEngine == SimulationEngine::Gather || m_simulationEngine == SimulationEngine::Streaming))
+		{
+			printf("Single photon buffer is not supported by gather engines\n");
+			s_photonBuffersCount = 2;
+		}
+		s_etherBrickSize = sizeof(EtherBrick) + sizeof(Photon) * ETHER_BRICK_CELLS * CELL_PHOTONS_COUNT * s_photonBuffersCount;
+		printf("Photon storage: %s, %s buffer\n", s_photonStorage == PhotonStorage::DirectionPlanes ? "direction planes" : "cell slots",
+			s_photonBuffersCount == 1 ? "single" : "double");
+		SelectUniverseTicks();
+		s_bricksSize.m_posX = (m_universeSize.m_posX + ETHER_BRICK_SIZE - 1) >> ETHER_BRICK_SIZE_SHIFT;
+		s_bricksSize.m_posY = (m_universeSize.m_posY + ETHER_BRICK_SIZE - 1) >> ETHER_BRICK_SIZE_SHIFT;
+		s_bricksSize.m_posZ = (m_universeSize.m_posZ + ETHER_BRICK_SIZE - 1) >> ETHER_BRICK_SIZE_SHIFT;
+		s_bricksStrideY = s_bricksSize.m_posZ;
+		s_bricksStrideX = s_bricksSize.m_posY * s_bricksStrideY;
+		for (int32_t posX = 0; posX < ETHER_BRICK_SIZE; ++posX)
 		{
-			itY.resize(m_universeSize.m_posY);
-			for (auto &itZ : itY)
+			for (int32_t posY = 0; posY < ETHER_BRICK_SIZE; ++posY)
 			{
-				itZ.resize(0);
-				EtherCell cell(EtherType::Space);
-				cell.m_color = EtherColor::ZeroColor;
+				for (int32_t posZ = 0; posZ < ETHER_BRICK_SIZE; ++posZ)
 				{
-					for (int ii = 0; ii < cell.m_photons[0].size(); ++ii)
-					{
-						cell.m_photons[0][ii].m_color.m_colorA = 0;
-					}
-				}
-				{
-					for (int ii = 0; ii < cell.m_photons[1].size(); ++ii)
-					{
-						cell.m_photons[1][ii].m_color.m_colorA = 0;
-					}
+					VectorInt32Math pos(posX, posY, posZ);
+					int32_t indexInBrick = GetIndexInBrick(GetCellIndex(pos));
+					int16_t linearIndex = (int16_t)((posX * ETHER_BRICK_SIZE + posY) * ETHER_BRICK_SIZE + posZ);
+					s_brickCellPositions[indexInBrick] = pos;
+					s_brickLinearIndices[indexInBrick] = linearIndex;
+					s_brickMortonIndices[linearIndex] = (int16_t)indexInBrick;
 				}
-				itZ.resize(m_universeSize.m_posZ, cell);
 			}
 		}
+		for (uint32_t ii = 0; ii < s_photonUnitVectors.size(); ++ii)
+		{
+			s_photonUnitVectors[ii] = GetUnitVectorFromPhotonIndex(ii);
+		}
+
+		size_t bricksCount = (size_t)s_bricksSize.m_posX * s_bricksStrideX;
+		size_t cellsCount = bricksCount * ETHER_BRICK_CELLS; // universe size rounded up to bricks
+		if (cellsCount > INT32_MAX)
+		{
+			printf("Universe is too big. Cells: %zu\n", cellsCount);
+			return false;
+		}
+		FreeEtherPlanes();
+		s_etherPaletteSize = 0;
+		uint8_t spaceColorIndex = 0;
+		GetPaletteIndex(EtherColor::ZeroColor, spaceColorIndex); // palette is empty
+		s_etherTypes = AllocateEtherPlane<std::atomic<uint8_t>>((cellsCount + 3) / 4);
+		s_etherColors = AllocateEtherPlane<uint8_t>(cellsCount);
+		s_etherBricks = AllocateEtherPlane<std::atomic<EtherBrick*>>(bricksCount);
+		if (!s_etherTypes || !s_etherColors || !s_etherBricks)
+		{
+			printf("Not enough memory for universe. Cells: %zu\n", cellsCount);
+			return false;
+		}
+		std::uninitialized_value_construct_n(s_etherBricks, bricksCount);
+		if (params.m_bPhotonJumps)
+		{
+			if (m_simulationEngine == SimulationEngine::Gather || m_simulationEngine == SimulationEngine::Streaming)
+			{
+				printf("Photon jumps are not supported by gather engines\n");
+			}
+			else if (!(s_emptyDistances = AllocateEtherPlane<uint8_t>(cellsCount)))
+			{
+				printf("Not enough memory for empty distances, photons don't jump\n");
+			}
+		}
+		s_emptyDistancesDirtyBox = BoxIntMath();
+		printf("Ether bricks: %zu, geometry: %zu MB, photons: %zu KB per brick\n", bricksCount,
+			(cellsCount / 4 + cellsCount + bricksCount * sizeof(EtherBrick*)) >> 20, s_etherBrickSize >> 10);
 
 		if (0 == threadsCount)
 		{
@@ -151,6 +670,9 @@ bool Init(const VectorInt32Math &universeSize, uint8_t threadsCount, uint32_t un
 		m_timingsUniverseThreads.resize(m_threadsCount);
 		m_TickTimeMusAverageUniverseThreads.resize(m_threadsCount);
 #endif
+		s_barrierWaitTimes.clear();
+		s_barrierWaitTimes.resize(m_threadsCount + 1);
+		m_barrierWaitMusAverage.assign(m_threadsCount + 1, 0);
 		// fill bounds
 
 		s_threadSimulateBounds.resize(m_threadsCount);
@@ -170,9 +692,119 @@ bool Init(const VectorInt32Math &universeSize, uint8_t threadsCount, uint32_t un
 			s_threadSimulateBounds[ii].m_maxVector = VectorInt32Math(endX, m_universeSize.m_posY, m_universeSize.m_posZ);
 			beginX = endX;
 		}
+		s_threadFarBounds = s_threadSimulateBounds;
+		s_simulateBoundingBox = BoxIntMath(VectorInt32Math::ZeroVector, m_universeSize);
+		s_simulateBoxes = { s_simulateBoundingBox };
+		s_farFieldPeriod = 0;
+		if (params.m_farFieldPeriod)
+		{
+			if (m_simulationEngine != SimulationEngine::BoxSweep)
+			{
+				printf("Far field is supported by box sweep engine only\n");
+			}
+			else
+			{
+				s_farFieldPeriod = std::min<uint32_t>(params.m_farFieldPeriod, PHOTON_WHEEL_SIZE - 1);
+				printf("Far field is stepped every %u quantums of time\n", s_farFieldPeriod);
+			}
+		}
+		s_epochTicks = 1;
+		if (params.m_epochTicks > 1)
+		{
+			if (m_simulationEngine != SimulationEngine::BoxSweep || s_photonBuffersCount == 1 || s_emptyDistances || s_farFieldPeriod)
+			{
+				printf("Epochs are supported by box sweep engine without single photon buffer, photon jumps and far field\n");
+			}
+			else
+			{
+				s_epochTicks = (int32_t)std::min<uint32_t>({ params.m_epochTicks, MAX_EPOCH_TICKS, (uint32_t)m_universeSize.m_posX / 2 });
+				printf("Universe threads simulate %d quantums of time between tick barriers\n", s_epochTicks);
+			}
+		}
+		s_simulationTileQueues.reset(new SimulationTileQueue[m_threadsCount]);
+		BuildSimulationTiles();
+		ResetSimulationTiles();
+		s_bAdaptiveThreads = false;
+		if (params.m_bAdaptiveThreads)
+		{
+			if (m_simulationEngine == SimulationEngine::ActivePhotons)
+			{
+				printf("Adaptive threads are not supported by active photons engine\n");
+			}
+			else
+			{
+				s_bAdaptiveThreads = m_threadsCount > 1;
+				printf("Universe threads count adapts to simulated volume\n");
+			}
+		}
+		s_activeThreadsCount = m_threadsCount;
+		s_parkedThreads.reset(new ParkedThread[m_threadsCount]);
+		s_activeThreadsTickNs.assign(m_threadsCount + 1, 0);
+		s_activeThreadsVolume = 0;
+		s_activeThreadsPeriodTime = 0;
+		s_activeThreadsPeriodsCount = 0;
+		s_threadByPosX.resize(m_universeSize.m_posX);
+		for (int ii = 0; ii < m_threadsCount; ++ii)
+		{
+			std::fill(s_threadByPosX.begin() + s_threadSimulateBounds[ii].m_minVector.m_posX,
+				s_threadByPosX.begin() + s_threadSimulateBounds[ii].m_maxVector.m_posX, (uint8_t)ii);
+		}
+		s_activeCells.clear();
+		s_activeCells.resize(m_threadsCount, std::vector<ActiveCells>(m_threadsCount + 1)); // universe threads and observers thread
+		s_vacatedCells.clear();
+		s_allocatedBricks.clear();
+		s_allocatedBricks.resize(m_threadsCount + 1);
+		s_haloPhotons.clear();
+		s_haloPhotons.resize(m_threadsCount + 1);
+		s_photonWheels.clear();
+		s_photonWheels.resize(m_threadsCount + 1);
+		s_culledPhotonSteps.clear();
+		s_culledPhotonSteps.resize(m_threadsCount + 1);
+		s_cullingObserverPositions.clear();
+
+		// ether placement
+		s_bLargePages = params.m_bLargePages && EnableLargePages();
+		s_etherChunkSize = ETHER_BRICKS_CHUNK_SIZE;
+		if (s_bLargePages)
+		{
+			size_t largePageSize = GetLargePageMinimum();
+			s_etherChunkSize = (std::max(s_etherChunkSize, s_etherBrickSize) + largePageSize - 1) / largePageSize * largePageSize;
+		}
+		ULONG highestNumaNode = 0;
+		s_bNumaPlacement = params.m_bNumaPlacement && GetNumaHighestNodeNumber(&highestNumaNode);
+		uint32_t numaNodesCount = s_bNumaPlacement ? highestNumaNode + 1 : 1;
+		s_threadNumaNodes.resize(m_threadsCount);
+		for (int ii = 0; ii < m_threadsCount; ++ii)
+		{
+			s_threadNumaNodes[ii] = ii * numaNodesCount / m_threadsCount; // neighbour X slabs share node
+		}
+		s_freeBricks.resize(numaNodesCount);
+		s_bPinThreads = params.m_bPinThreads && PlanThreadCpus();
+		printf("Ether placement: %s pages, bricks chunk %zu KB, NUMA nodes: %u%s\n", s_bLargePages ? "large" : "regular", s_etherChunkSize >> 10,
+			numaNodesCount, s_bNumaPlacement ? "" : " (placement disabled)");
+		for (int ii = 0; ii < m_threadsCount; ++ii)
+		{
+			printf("  universe thread %d: X [%d; %d) node %u", ii, s_threadSimulateBounds[ii].m_minVector.m_posX,
+				s_threadSimulateBounds[ii].m_maxVector.m_posX, s_threadNumaNodes[ii]);
+			if (s_bPinThreads)
+			{
+				printf(" cpu %u:%u", s_threadCpus[ii].Group, s_threadCpus[ii].Number);
+			}
+			printf("\n");
+		}
+		if (s_bPinThreads)
+		{
+			printf("  observers thread: cpu %u:%u, admin thread: cpu %u:%u\n", s_threadCpus[m_threadsCount].Group,
+				s_threadCpus[m_threadsCount].Number, s_adminTcpCpu.Group, s_adminTcpCpu.Number);
+		}
+		FirstTouchEtherPlanes(spaceColorIndex);
 
 		static std::thread s_adminTcpThread;
 		s_adminTcpThread = std::thread(AdminTcpThread);
+		if (s_bPinThreads)
+		{
+			PinThreadToCpu((HANDLE)s_adminTcpThread.native_handle(), s_adminTcpCpu);
+		}
 		return true;
 	}
 	return false;
@@ -189,13 +821,13 @@ bool SaveUniverse(const std::string &fileName)
 	myfile.open(fileName);
 	if (myfile.is_open())
 	{
-		for (int32_t posX = 0; posX < s_universe.size(); ++posX)
+		for (int32_t posX = 0; posX < m_universeSize.m_posX; ++posX)
 		{
-			for (int32_t posY = 0; posY < s_universe[posX].size(); ++posY)
+			for (int32_t posY = 0; posY < m_universeSize.m_posY; ++posY)
 			{
-				for (int32_t posZ = 0; posZ < s_universe[posX][posY].size(); ++posZ)
+				for (int32_t posZ = 0; posZ < m_universeSize.m_posZ; ++posZ)
 				{
-					myfile << (uint8_t)s_universe[posX][posY][posZ].m_type;
+					myfile << (uint8_t)GetEtherType(GetCellIndex(VectorInt32Math(posX, posY, posZ)));
 				}
 			}
 		}
@@ -205,7 +837,7 @@ bool SaveUniverse(const std::string &fileName)
 	return false;
 }
 
-void InitScaledCell(uint32_t posX, uint32_t posY, uint32_t posZ, int32_t cellType)
+bool InitScaledCell(uint32_t posX, uint32_t posY, uint32_t posZ, int32_t cellType)
 {
 	constexpr uint8_t grayColor = 50;
 	EtherColor cellColor(grayColor, grayColor, grayColor);
@@ -215,7 +847,11 @@ void InitScaledCell(uint32_t posX, uint32_t posY, uint32_t posZ, int32_t cellTyp
 		std::array<EtherColor, 4> Colors = { EtherColor(255,0,0), EtherColor(0,255,0), EtherColor(0,0,255), EtherColor(255,255,0) };
 		cellColor = Colors[Rand32(4)];
 	}
-
+	uint8_t colorIndex = 0;
+	if (!GetPaletteIndex(cellColor, colorIndex))
+	{
+		return false;
+	}
 
 	for (uint32_t xx = 0; xx < GetUniverseScale(); ++xx)
 	{
@@ -223,12 +859,13 @@ void InitScaledCell(uint32_t posX, uint32_t posY, uint32_t posZ, int32_t cellTyp
 		{
 			for (uint32_t zz = 0; zz < GetUniverseScale(); ++zz)
 			{
-				EtherCell &cell = s_universe[posX+xx][posY+yy][posZ+zz];
-				cell.m_type = cellType;
-				cell.m_color = cellColor;
+				int32_t cellIndex = GetCellIndex(VectorInt32Math(posX + xx, posY + yy, posZ + zz));
+				SetEtherType(cellIndex, cellType);
+				s_etherColors[cellIndex] = colorIndex;
 			}
 		}
 	}
+	return true;
 }
 
 bool LoadUniverse(const std::string &fileName)
@@ -236,683 +873,2484 @@ bool LoadUniverse(const std::string &fileName)
 	std::ifstream myfile(fileName);
 	if (myfile.is_open())
 	{
-		for (uint32_t posX = 0; posX < s_universe.size(); posX += GetUniverseScale())
+		for (uint32_t posX = 0; posX < m_universeSize.m_posX; posX += GetUniverseScale())
 		{
-			for (uint32_t posY = 0; posY < s_universe[posX].size(); posY += GetUniverseScale())
+			for (uint32_t posY = 0; posY < m_universeSize.m_posY; posY += GetUniverseScale())
 			{
-				for (uint32_t posZ = 0; posZ < s_universe[posX][posY].size(); posZ += GetUniverseScale())
+				for (uint32_t posZ = 0; posZ < m_universeSize.m_posZ; posZ += GetUniverseScale())
 				{
 					char ch = myfile.get();
-					if (!myfile.good())
+					if (!myfile.good() || !InitScaledCell(posX, posY, posZ, (EtherType::EEtherType)ch))
 					{
 						return false;
 					}
-					InitScaledCell(posX, posY, posZ, (EtherType::EEtherType)ch);
 				}
 			}
 		}
 		myfile.close();
+		InvalidateEmptyDistances(VectorInt32Math::ZeroVector);
+		InvalidateEmptyDistances(m_universeSize - VectorInt32Math::OneVector);
+		UpdateEmptyDistances();
 		return true;
 	}
 	return false;
 }
 
-void PhotonStepForward(const VectorInt32Math &pos, Photon &photon, const EtherCell &cell)
+// Returns false if photon is weakened to zero
+__forceinline bool ReflectAndWeakenPhoton(int32_t cellIndex, Photon &photon, uint32_t weakening)
 {
-	if (cell.m_type == EtherType::Crumb || cell.m_type == EtherType::Block || cell.m_type == EtherType::Observer)
+	int32_t cellType = GetEtherType(cellIndex);
+	if (cellType == EtherType::Crumb || cellType == EtherType::Block || cellType == EtherType::Observer)
 	{
 		photon.m_orientation *= -1;
 		uint8_t tmpA = photon.m_color.m_colorA;
-		photon.m_color = cell.m_color;
+		photon.m_color = GetEtherColor(cellIndex);
 		photon.m_color.m_colorA = tmpA;
 	}
-	if (photon.m_color.m_colorA > GetPhotonWeakening())
+	if (photon.m_color.m_colorA <= weakening)
 	{
-		photon.m_color.m_colorA -= GetPhotonWeakening();
-		bool result = EmitPhoton(pos, photon);
-		//if (result)
-		{
-			photon.m_color = EtherColor::ZeroColor;
-		}
+		return false;
 	}
-	else
+	photon.m_color.m_colorA -= weakening;
+	return true;
+}
+
+// photon slot is treated as empty after the call, caller is responsible to clear its bit in photons mask
+void PhotonStepForward(const VectorInt32Math &pos, int32_t cellIndex, Photon &photon)
+{
+	if (ReflectAndWeakenPhoton(cellIndex, photon, GetPhotonWeakening()))
 	{
-		photon.m_color = EtherColor::ZeroColor;
+		EmitPhoton(pos, photon);
 	}
 }
 
-void UniverseThread(int32_t threadNum)
+// fields of photon for ordering and comparison. Fourth byte of orientation union and tail padding are never written, so they are skipped
+__forceinline auto GetPhotonFields(const Photon &photon)
 {
-	while (m_isSimulationRunning)
+	const EtherColor &color = photon.m_color;
+	const OrientationVectorMath &orient = photon.m_orientation;
+	return std::make_tuple(color.m_colorB, color.m_colorG, color.m_colorR, color.m_colorA, orient.m_posX, orient.m_posY, orient.m_posZ,
+		photon.m_param, photon.m_param2, photon.m_stepPhase);
+}
+
+// Collision policy: brighter photon wins the slot, photons of equal brightness are ordered by their fields.
+// Result doesn't depend on order of emission, so merge of halo photons gives same ether for any order of threads
+__forceinline bool IsPhotonStronger(const Photon &photon, const Photon &other)
+{
+	if (photon.m_color.m_colorA != other.m_color.m_colorA)
 	{
-#ifdef HIGH_PRECISION_STATS
-		auto beginTime = std::chrono::high_resolution_clock::now();
-#endif
-		int isTimeOdd = s_time % 2;
+		return photon.m_color.m_colorA > other.m_color.m_colorA;
+	}
+	return GetPhotonFields(photon) < GetPhotonFields(other);
+}
 
-		for (int32_t posX = s_threadSimulateBounds[threadNum].m_minVector.m_posX; posX < s_threadSimulateBounds[threadNum].m_maxVector.m_posX; ++posX)
+// Compare kernel: random bytes are drawn photon by photon as CalculatePositionShift draws them, then kernel results are checked
+// against original per-photon path of PhotonStepForward, which replays the same bytes from copy of thread random stream
+void StepEtherCellCompared(int32_t cellIndex, PhotonKernel::CellPhotonsStep &step)
+{
+	RandomStream referenceStream = t_randomStream;
+	uint32_t photonsCount = CountBits(step.m_photonsMask);
+	if (m_photonStepMode == PhotonKernel::StepMode::Random)
+	{
+		for (uint32_t ii = 0; ii < photonsCount; ++ii)
 		{
-			for (int32_t posY = s_threadSimulateBounds[threadNum].m_minVector.m_posY; posY < s_threadSimulateBounds[threadNum].m_maxVector.m_posY; ++posY)
+			for (auto &randomBytes : step.m_randomBytes)
 			{
-				for (int32_t posZ = s_threadSimulateBounds[threadNum].m_minVector.m_posZ; posZ < s_threadSimulateBounds[threadNum].m_maxVector.m_posZ; ++posZ)
-				{
-					EtherCell &cell = s_universe[posX][posY][posZ];
-					if (cell.m_type == EtherType::Observer)
-					{
-						continue;
-					}
-					for (int ii = 0; ii < cell.m_photons[isTimeOdd].size(); ++ii)
-					{
-						Photon &photon = cell.m_photons[isTimeOdd][ii];
-						if (photon.m_color.m_colorA != 0)
-						{
-							PhotonStepForward({ posX, posY, posZ }, photon, cell);
-						}
-					}
-				}
+				randomBytes[ii] = t_randomStream.NextByte();
 			}
 		}
-#ifdef HIGH_PRECISION_STATS
-		auto endTime = std::chrono::high_resolution_clock::now();
-		auto dif = endTime - beginTime;
-		m_timingsUniverseThreads[threadNum] += (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(dif).count();
-#endif
-		if (threadNum == 0)
-		{ // zero thread actually running in simulation thread
-			break;
+	}
+	PhotonKernel::StepCellPhotons(step);
+
+	std::swap(t_randomStream, referenceStream);
+	bool bEqual = step.m_photonsCount == photonsCount;
+	uint32_t count = 0;
+	for (uint32_t mask = step.m_photonsMask; bEqual && mask; mask &= mask - 1, ++count)
+	{
+		Photon photon = step.m_photons[CountTrailingZeros(mask) * step.m_photonsStride];
+		bool bAlive = ReflectAndWeakenPhoton(cellIndex, photon, step.m_weakening);
+		VectorInt32Math unitVector;
+		if (m_photonStepMode == PhotonKernel::StepMode::Random)
+		{
+			unitVector = CalculatePositionShift(GetCellPos(cellIndex), photon.m_orientation);
+			++photon.m_stepPhase;
 		}
-		--s_waitThreadsCount;
-		while (s_time % 2 == isTimeOdd)
+		else
 		{
+			VectorInt8Math shift = PhotonKernel::StepPhoton(m_photonStepMode, photon);
+			unitVector = VectorInt32Math(shift.m_posX, shift.m_posY, shift.m_posZ);
 		}
+		const VectorInt8Math &stepUnitVector = step.m_unitVectors[count];
+		bEqual = bAlive == ((step.m_aliveMask >> count) & 1) && (!bAlive ||
+			(GetPhotonFields(photon) == GetPhotonFields(step.m_outPhotons[count]) &&
+			!(VectorInt32Math(stepUnitVector.m_posX, stepUnitVector.m_posY, stepUnitVector.m_posZ) != unitVector) &&
+			step.m_photonIndices[count] == GetCellPhotonIndex(unitVector)));
+	}
+	std::swap(t_randomStream, referenceStream);
+	if (!bEqual)
+	{
+		PhotonKernel::ReportCompareMismatch("PhotonStepForward", step.m_photonsMask);
 	}
-	--s_waitThreadsCount;
 }
 
-const VectorInt32Math & GetUniverseSize()
+// tick kernel, constants of universe scale and quantum of time parity are folded in every instantiation. Returns false if cell has no photons to step
+template<uint32_t UNIVERSE_SCALE, int32_t IS_TIME_ODD>
+__forceinline bool StepEtherCell(int32_t cellIndex, PhotonKernel::CellPhotonsStep &step)
 {
-	return m_universeSize;
+	std::atomic<uint32_t> &photonsMask = GetEtherPhotonsMask(cellIndex, IS_TIME_ODD);
+	uint32_t mask = photonsMask.load(std::memory_order_relaxed);
+	if (!mask)
+	{
+		return false;
+	}
+	int32_t cellType = GetEtherType(cellIndex);
+	if (cellType == EtherType::Observer)
+	{
+		return false;
+	}
+	photonsMask.store(0, std::memory_order_relaxed);
+	step.m_photons = &GetEtherPhoton(cellIndex, IS_TIME_ODD, 0);
+	step.m_photonsStride = GetEtherPhotonsStride();
+	step.m_photonsMask = mask;
+	step.m_bReflect = cellType != EtherType::Space;
+	step.m_cellColor = GetEtherColor(cellIndex);
+	step.m_weakening = (uint8_t)GetPhotonWeakening<UNIVERSE_SCALE>();
+	step.m_stepMode = m_photonStepMode;
+	if (PhotonKernel::IsCompareKernel())
+	{
+		StepEtherCellCompared(cellIndex, step);
+		return true;
+	}
+	if (m_photonStepMode == PhotonKernel::StepMode::Random)
+	{
+		uint32_t photonsCount = CountBits(mask);
+		for (auto &randomBytes : step.m_randomBytes)
+		{
+			t_randomStream.FillBytes(randomBytes.data(), photonsCount);
+		}
+	}
+	PhotonKernel::StepCellPhotons(step);
+	return true;
 }
 
-void AdjustSimulationBoxes()
+// Photon which reaches nextPos at emitTime flies through empty space. Instead of stepping cell by cell it's stepped at once,
+// weakened by all steps and put to timing wheel. Returns false if photon should be emitted as usual
+template<uint32_t UNIVERSE_SCALE>
+__forceinline bool JumpPhoton(const VectorInt32Math &nextPos, Photon photon, uint64_t emitTime)
 {
-	if (!s_observers.size())
+	if (!IsPosInBounds(nextPos))
 	{
-		return;
+		return false;
 	}
-
-	const Observer *observer = s_observers[0].m_observer;
-	VectorInt32Math observerPos = s_observers[0].m_position;
-
-	VectorInt32Math boundsMin;
+	uint32_t weakening = GetPhotonWeakening<UNIVERSE_SCALE>();
+	int32_t jumpLength = (s_emptyDistances[GetCellIndex(nextPos)] - 2) / 2;
+	if (weakening)
 	{
-		VectorInt32Math boundSize(GetSimulationSize(), GetSimulationSize(), GetSimulationSize());
-		const VectorInt32Math &orientMinChanger = observer->GetOrientMinChanger();
-		boundSize.m_posX = std::min(boundSize.m_posX, orientMinChanger.m_posX);
-		boundSize.m_posY = std::min(boundSize.m_posY, orientMinChanger.m_posY);
-		boundSize.m_posZ = std::min(boundSize.m_posZ, orientMinChanger.m_posZ);
-		boundsMin = observerPos - boundSize;
-		AdjustSizeByBounds(boundsMin);
+		jumpLength = std::min<int32_t>(jumpLength, (photon.m_color.m_colorA - 1) / weakening); // photon survives every step
 	}
-
-	VectorInt32Math boundsMax;
+	if (jumpLength < PHOTON_JUMP_MIN)
 	{
-		VectorInt32Math boundSize(GetSimulationSize(), GetSimulationSize(), GetSimulationSize());
-		const VectorInt32Math &orientMaxChanger = observer->GetOrientMaxChanger();
-		boundSize.m_posX = std::min(boundSize.m_posX, orientMaxChanger.m_posX);
-		boundSize.m_posY = std::min(boundSize.m_posY, orientMaxChanger.m_posY);
-		boundSize.m_posZ = std::min(boundSize.m_posZ, orientMaxChanger.m_posZ);
-		boundsMax = observerPos + boundSize + VectorInt32Math::OneVector; // [minVector; maxVector)
-		AdjustSizeByBounds(boundsMax);
+		return false;
 	}
-	
-	int32_t lengthX = boundsMax.m_posX - boundsMin.m_posX;
-	int32_t partX = lengthX / m_threadsCount;
-	int32_t remain = lengthX - partX * m_threadsCount;
+	VectorInt32Math landingPos = nextPos;
+	VectorInt32Math shift;
+	for (int32_t ii = 0; ii < jumpLength; ++ii)
+	{
+		VectorInt8Math unitVector = PhotonKernel::StepPhoton(m_photonStepMode, photon);
+		shift = VectorInt32Math(unitVector.m_posX, unitVector.m_posY, unitVector.m_posZ);
+		landingPos = landingPos + shift;
+	}
+	if (!IsPosInBounds(landingPos))
+	{
+		return true; // photon leaves universe, axes move monotonically so it doesn't come back
+	}
+	photon.m_color.m_colorA -= (uint8_t)(jumpLength * weakening);
+	s_photonWheels[t_threadIndex].m_photons[(emitTime + jumpLength) % PHOTON_WHEEL_SIZE].push_back(
+		{ landingPos.m_posX, GetCellIndex(landingPos), (int32_t)GetCellPhotonIndex(shift), photon });
+	return true;
+}
 
-	int32_t posXBegin = boundsMin.m_posX;
-	for (int ii = 0; ii < m_threadsCount; ++ii)
+// Energy horizon: photon emitted from pos makes at most (alpha - 1) / weakening moves more, observers meanwhile come closer by cell
+// per quantum of time. Photons which can't reach body of any observer even then are removed from step
+template<uint32_t UNIVERSE_SCALE>
+__forceinline void CullPhotonsBeyondHorizon(const VectorInt32Math &pos, PhotonKernel::CellPhotonsStep &step)
+{
+	uint32_t weakening = GetPhotonWeakening<UNIVERSE_SCALE>();
+	if (!weakening || s_cullingObserverPositions.empty())
 	{
-		int32_t posXEnd = posXBegin + partX;
-		if (0 < remain)
+		return;
+	}
+	int32_t observerDistance = INT32_MAX;
+	for (const VectorInt32Math &observerPos : s_cullingObserverPositions)
+	{
+		VectorInt32Math shift = observerPos - pos;
+		observerDistance = std::min(observerDistance, std::max(std::abs(shift.m_posX), std::max(std::abs(shift.m_posY), std::abs(shift.m_posZ))));
+	}
+	observerDistance -= (IS_DAPHNIA_BIG ? 1 : 0) + 2; // body radius, emission to neighbour cell and observer move before first step
+	uint64_t culledSteps = 0;
+	for (uint32_t aliveMask = step.m_aliveMask; aliveMask; aliveMask &= aliveMask - 1)
+	{
+		uint32_t ii = CountTrailingZeros(aliveMask);
+		int32_t moves = (step.m_outPhotons[ii].m_color.m_colorA - 1) / weakening;
+		if (2 * moves < observerDistance)
 		{
-			++posXEnd;
-			--remain;
+			step.m_aliveMask &= ~(1 << ii);
+			culledSteps += moves + 1;
 		}
-		s_threadSimulateBounds[ii] = BoxIntMath({ posXBegin, boundsMin.m_posY, boundsMin.m_posZ }, { posXEnd, boundsMax.m_posY, boundsMax.m_posZ });
-		posXBegin = posXEnd;
 	}
-	s_bNeedUpdateSimulationBoxes = false;
+	s_culledPhotonSteps[t_threadIndex].m_count += culledSteps;
 }
 
-SOCKET s_socketForNewClient = -1;
-void CreateSocketForNewClient()
+// push: photons of cell are emitted to neighbour cells
+template<uint32_t UNIVERSE_SCALE, SimulationEngine ENGINE, int32_t IS_TIME_ODD>
+__forceinline void SimulateCell(const VectorInt32Math &pos, int32_t cellIndex, uint64_t emitTime)
 {
-	if (s_observers.size() < CommonParams::MAX_CLIENTS)
+	PhotonKernel::CellPhotonsStep step;
+	if (!StepEtherCell<UNIVERSE_SCALE, IS_TIME_ODD>(cellIndex, step))
 	{
-		// UDP
-		SOCKET socketS;
-		struct sockaddr_in local;
-		local.sin_family = AF_INET;
-		local.sin_port = htons(CommonParams::CLIENT_UDP_PORT_START + (u_short)s_observers.size());
-		local.sin_addr.s_addr = INADDR_ANY;
-		socketS = socket(AF_INET, SOCK_DGRAM, 0);
-		bind(socketS, (sockaddr*)&local, sizeof(local));
-		u_long mode = 1;  // 1 to enable non-blocking socket
-		ioctlsocket(socketS, FIONBIO, &mode);
-		s_socketForNewClient = socketS;
+		return;
 	}
-	else
+	if (s_bEnergyHorizonCulling)
 	{
-		assert(s_socketForNewClient == -1);
+		CullPhotonsBeyondHorizon<UNIVERSE_SCALE>(pos, step);
+	}
+	for (uint32_t aliveMask = step.m_aliveMask; aliveMask; aliveMask &= aliveMask - 1)
+	{
+		uint32_t ii = CountTrailingZeros(aliveMask);
+		const VectorInt8Math &unitVector = step.m_unitVectors[ii];
+		VectorInt32Math shift(unitVector.m_posX, unitVector.m_posY, unitVector.m_posZ);
+		if (s_emptyDistances && JumpPhoton<UNIVERSE_SCALE>(pos + shift, step.m_outPhotons[ii], emitTime))
+		{
+			continue;
+		}
+		EmitPhoton<ENGINE, 1 - IS_TIME_ODD>(pos, step.m_outPhotons[ii], shift, step.m_photonIndices[ii], emitTime);
 	}
 }
 
-void StartSimulation()
+// gather, first pass: photons of cell are moved to slots of their outgoing direction. Direction is chosen here, on source side
+template<uint32_t UNIVERSE_SCALE, int32_t IS_TIME_ODD>
+__forceinline void ScatterCell(const VectorInt32Math &pos, int32_t cellIndex)
 {
-	// init sockets
-	WSADATA wsaData;
-	WSAStartup(MAKEWORD(2, 2), &wsaData);
-	CreateSocketForNewClient();
-	m_isSimulationRunning = true;
-
-
-		
-	// threads
-	std::vector<std::thread> threads;
-	threads.resize(m_threadsCount);
-
-	s_waitThreadsCount = 1; // observer thread only before first connection
-	std::thread observersThread = std::thread([]()
+	PhotonKernel::CellPhotonsStep step;
+	if (!StepEtherCell<UNIVERSE_SCALE, IS_TIME_ODD>(cellIndex, step))
 	{
-		while (m_isSimulationRunning)
+		return;
+	}
+	if (s_bEnergyHorizonCulling)
+	{
+		CullPhotonsBeyondHorizon<UNIVERSE_SCALE>(pos, step);
+	}
+	EtherBrick *brick = GetEtherBrick(cellIndex); // step holds copy of incoming photons
+	int32_t indexInBrick = GetIndexInBrick(cellIndex);
+	uint32_t outgoingMask = 0;
+	for (uint32_t aliveMask = step.m_aliveMask; aliveMask; aliveMask &= aliveMask - 1)
+	{
+		uint32_t ii = CountTrailingZeros(aliveMask);
+		uint32_t photonIndex = step.m_photonIndices[ii];
+		uint32_t photonBit = 1 << photonIndex;
+		Photon &outgoingPhoton = GetEtherPhoton(brick, indexInBrick, IS_TIME_ODD, photonIndex);
+		if (!(outgoingMask & photonBit) || IsPhotonStronger(step.m_outPhotons[ii], outgoingPhoton))
 		{
-#ifdef HIGH_PRECISION_STATS
-			auto beginTime = std::chrono::high_resolution_clock::now();
-#endif
-			if (s_socketForNewClient != -1)
-			{
-
-				char buffer[CommonParams::DEFAULT_BUFLEN];
-				struct sockaddr_in from;
-				int fromlen = sizeof(from);
-				while (recvfrom(s_socketForNewClient, buffer, sizeof(buffer), 0, (sockaddr*)&from, &fromlen) > 0)
-				{
-					if (const MsgCheckVersion *msg = QueryMessage<MsgCheckVersion>(buffer))
-					{
-						MsgCheckVersionResponse msgGetVersionResponse;
-						msgGetVersionResponse.m_observerId = 0;
-						if (msg->m_clientVersion == CommonParams::PROTOCOL_VERSION)
-						{
-							uint8_t observerIndex = (uint8_t)s_observers.size();
-							uint8_t eyeSize = 16;
-							if (msg->m_observerType == static_cast<uint8_t>(CommonParams::ObserverType::Daphnia8x8))
-							{
-								eyeSize = 8;
-							}
-							PPh::VectorInt32Math staticPos(102, 405, 61);
-							if (s_observers.size() == 1)
-							{
-								staticPos = PPh::VectorInt32Math(84, 405, 73);
-							}
-							s_observers.push_back(ObserverCell(new Observer(observerIndex, eyeSize), staticPos, s_socketForNewClient, from));
-							//s_observers.push_back(ObserverCell(new Observer(observerIndex, eyeSize), GetRandomEmptyCell(), s_socketForNewClient, from));
-							InitEtherCell(s_observers.back().m_position, EtherType::Observer, EtherColor(255, 255, 255, observerIndex));
-							MoveDaphniaToNextCell(s_observers.back().m_position, VectorInt32Math::ZeroVector); // make Daphnia bigger
-							s_socketForNewClient = -1;
-							CreateSocketForNewClient();
-							msgGetVersionResponse.m_observerId = reinterpret_cast<uint64_t>(s_observers.back().m_observer);
-						}
-						else
-						{
-							printf("Client refused with wrong protocol version. Server version: %d. Client version: %d\n", CommonParams::PROTOCOL_VERSION, msg->m_clientVersion);
-						}
-						msgGetVersionResponse.m_serverVersion = CommonParams::PROTOCOL_VERSION;
-						sendto(s_socketForNewClient, msgGetVersionResponse.GetBuffer(), sizeof(msgGetVersionResponse), 0, (sockaddr*)&from, fromlen);
-					}
-				}
-			}
-
-			int32_t isTimeOdd = s_time % 2;
-			for (auto &observer : s_observers)
-			{
-				observer.m_observer->PPhTick(s_time);
-				//ClearReceivedPhotons(observer.m_observer);
-			}
-
-#ifdef HIGH_PRECISION_STATS
-			auto endTime = std::chrono::high_resolution_clock::now();
-			m_timingsObserverThread += (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(endTime - beginTime).count();
-#endif
-			--s_waitThreadsCount;
-			while (s_time % 2 == isTimeOdd)
-			{
-			}
+			outgoingPhoton = step.m_outPhotons[ii];
+			outgoingMask |= photonBit;
 		}
-		--s_waitThreadsCount;
-	});
+	}
+	GetEtherPhotonsMask(cellIndex, IS_TIME_ODD).store(outgoingMask, std::memory_order_relaxed);
+}
 
-	// wait first observer
-	while (m_isSimulationRunning)
+// gather, second pass: slot of photon is its incoming direction, so every slot is taken from the only neighbour.
+// Cell is written by its owner thread only, sources outside of simulated boxes were not scattered
+template<int32_t IS_TIME_ODD>
+__forceinline void GatherCell(const VectorInt32Math &pos, int32_t cellIndex, uint64_t emitTime)
+{
+	constexpr int32_t IS_NEXT_TIME_ODD = 1 - IS_TIME_ODD;
+	EtherBrick *brick = GetEtherBrick(cellIndex);
+	int32_t indexInBrick = GetIndexInBrick(cellIndex);
+	uint32_t mask = 0;
+	for (uint32_t ii = 0; ii < s_photonUnitVectors.size(); ++ii)
 	{
-		while (s_waitThreadsCount)
+		VectorInt32Math sourcePos = pos - s_photonUnitVectors[ii];
+		if (!IsPosSimulated(sourcePos))
 		{
+			continue;
 		}
-		if (s_observers.size())
+		int32_t sourceIndex = GetCellIndex(sourcePos);
+		uint32_t photonBit = 1 << ii;
+		if (!(GetEtherPhotonsMask(sourceIndex, IS_TIME_ODD).load(std::memory_order_relaxed) & photonBit) ||
+			GetEtherType(sourceIndex) == EtherType::Observer) // observer cell holds photons for observers thread
 		{
-			break;
+			continue;
 		}
-		Sleep(100);
-		s_waitThreadsCount = 1; // observer thread only before first connection
-		++s_time;
+		if (!brick)
+		{
+			brick = AllocateEtherBrick(cellIndex);
+			if (!brick)
+			{
+				return;
+			}
+		}
+		GetEtherPhoton(brick, indexInBrick, IS_NEXT_TIME_ODD, ii) = GetEtherPhoton(sourceIndex, IS_TIME_ODD, ii);
+		mask |= photonBit;
 	}
-
-	s_waitThreadsCount = m_threadsCount + 1; // universe threads and observers thread
-	++s_time;
-	if (m_bSimulateNearObserver)
+	if (brick)
 	{
-		AdjustSimulationBoxes();
+		if (mask && brick->m_lastEmitTime.load(std::memory_order_relaxed) != emitTime)
+		{
+			brick->m_lastEmitTime.store(emitTime, std::memory_order_relaxed);
+		}
+		brick->m_photonMasks[IS_NEXT_TIME_ODD][indexInBrick].store(mask, std::memory_order_relaxed);
 	}
-	for (int ii = 1; ii < m_threadsCount; ++ii)
+}
+
+// streaming: slot plane rows of source brick are copied to shifted rows of destination brick
+struct PlaneRowCopy
+{
+	EtherBrick *m_sourceBrick;
+	int16_t m_slot;
+	int16_t m_sourceIndex; // linear indices in brick
+	int16_t m_destIndex;
+	int16_t m_count;
+};
+thread_local std::vector<PlaneRowCopy> t_planeRowCopies;
+
+// streaming, second pass: every slot plane of brick cells in bounds is taken from current parity planes of brick and its neighbours,
+// shifted by unit vector of slot. Rows may carry photons without mask bit, masks decide which photons exist
+template<int32_t IS_TIME_ODD>
+void StreamBrick(int32_t brickCellIndex, const VectorInt32Math &brickPos, const BoxIntMath &bounds, uint64_t emitTime)
+{
+	const BoxIntMath &sourceBounds = s_simulateBoundingBox;
+	bool isSourceBoundsExact = s_simulateBoxes.size() == 1;
+	constexpr int32_t IS_NEXT_TIME_ODD = 1 - IS_TIME_ODD;
+	constexpr int32_t localMask = ETHER_BRICK_SIZE - 1;
+	VectorInt32Math cellsMin, cellsMax; // cells of brick in bounds, [min; max)
+	for (int32_t axis = 0; axis < 3; ++axis)
 	{
-		threads[ii] = std::thread(UniverseThread, ii);
+		cellsMin.m_posArray[axis] = std::max(bounds.m_minVector.m_posArray[axis] - brickPos.m_posArray[axis], 0);
+		cellsMax.m_posArray[axis] = std::min(bounds.m_maxVector.m_posArray[axis] - brickPos.m_posArray[axis], ETHER_BRICK_SIZE);
+		if (cellsMin.m_posArray[axis] >= cellsMax.m_posArray[axis])
+		{
+			return;
+		}
 	}
-
-	int64_t lastTime = GetTimeMs();
-	uint64_t lastTimeUniverse = 0;
-	while (m_isSimulationRunning)
+	// [x + 1][y + 1][z + 1] of neighbour brick
+	std::array<EtherBrick*, 27> sourceBricks;
+	std::array<int32_t, 27> sourceBrickCellIndices;
+	VectorInt32Math brick(brickPos.m_posX >> ETHER_BRICK_SIZE_SHIFT, brickPos.m_posY >> ETHER_BRICK_SIZE_SHIFT, brickPos.m_posZ >> ETHER_BRICK_SIZE_SHIFT);
+	for (int32_t neighbour = 0; neighbour < 27; ++neighbour)
 	{
-		UniverseThread(0);
-		while (s_waitThreadsCount)
+		VectorInt32Math sourceBrick = brick + VectorInt32Math(neighbour / 9 - 1, neighbour / 3 % 3 - 1, neighbour % 3 - 1);
+		sourceBricks[neighbour] = nullptr;
+		if (0 <= sourceBrick.m_posX && sourceBrick.m_posX < s_bricksSize.m_posX && 0 <= sourceBrick.m_posY && sourceBrick.m_posY < s_bricksSize.m_posY &&
+			0 <= sourceBrick.m_posZ && sourceBrick.m_posZ < s_bricksSize.m_posZ)
 		{
+			int32_t brickIndex = sourceBrick.m_posX * s_bricksStrideX + sourceBrick.m_posY * s_bricksStrideY + sourceBrick.m_posZ;
+			sourceBricks[neighbour] = s_etherBricks[brickIndex].load(std::memory_order_acquire);
+			sourceBrickCellIndices[neighbour] = brickIndex << ETHER_BRICK_CELLS_SHIFT;
 		}
-		s_waitThreadsCount = m_threadsCount + 1; // universe threads and observers thread
-		uint64_t adminObserverId = m_adminObserverId.load(std::memory_order_relaxed);
-		for (ObserverCell &observer : s_observers)
+	}
+
+	std::array<uint32_t, ETHER_BRICK_CELLS> masks; // by linear index
+	masks.fill(0);
+	std::vector<PlaneRowCopy> &rowCopies = t_planeRowCopies;
+	rowCopies.clear();
+	for (int32_t slot = 0; slot < CELL_PHOTONS_COUNT; ++slot)
+	{
+		const VectorInt32Math &unitVector = s_photonUnitVectors[slot];
+		uint32_t photonBit = 1 << slot;
+		for (int32_t posX = cellsMin.m_posX; posX < cellsMax.m_posX; ++posX)
 		{
-			bool moveForward = observer.m_observer->GrabMoveForward();
-			bool moveBackward = observer.m_observer->GrabMoveBackward();
-			if (moveForward || moveBackward)
+			int32_t sourceX = posX - unitVector.m_posX;
+			if (brickPos.m_posX + sourceX < sourceBounds.m_minVector.m_posX || brickPos.m_posX + sourceX >= sourceBounds.m_maxVector.m_posX)
 			{
-				assert(s_observers.size() > observer.m_observer->m_index);
-				VectorInt32Math pos = observer.m_position;
-				OrientationVectorMath orient = observer.m_observer->GetOrientation();
-				if (moveBackward)
+				continue;
+			}
+			for (int32_t posY = cellsMin.m_posY; posY < cellsMax.m_posY; ++posY)
+			{
+				int32_t sourceY = posY - unitVector.m_posY;
+				if (brickPos.m_posY + sourceY < sourceBounds.m_minVector.m_posY || brickPos.m_posY + sourceY >= sourceBounds.m_maxVector.m_posY)
 				{
-					orient *= -1;
+					continue;
 				}
-				VectorInt32Math unitVector = CalculatePositionShift(observer.m_position, orient);
-				VectorInt32Math nextPos = pos + unitVector;
-				VectorInt32Math outEatenCrumbPos = VectorInt32Math::ZeroVector;
-				if (CanDaphniaMoveToNextCell(pos, unitVector, outEatenCrumbPos))
+				int32_t rowCopy = -1; // index in rowCopies of current row
+				for (int32_t posZ = cellsMin.m_posZ; posZ < cellsMax.m_posZ; ++posZ)
 				{
-					if (outEatenCrumbPos != VectorInt32Math::ZeroVector)
+					int32_t sourceZ = posZ - unitVector.m_posZ;
+					if (brickPos.m_posZ + sourceZ < sourceBounds.m_minVector.m_posZ || brickPos.m_posZ + sourceZ >= sourceBounds.m_maxVector.m_posZ ||
+						(!isSourceBoundsExact && !IsPosSimulated(brickPos + VectorInt32Math(sourceX, sourceY, sourceZ))))
 					{
-						VectorInt32Math crumbPos = DestroyCrumb(outEatenCrumbPos, true);
-						observer.m_observer->IncEatenCrumb(crumbPos);
+						continue;
+					}
+					int32_t neighbour = (((sourceX >> ETHER_BRICK_SIZE_SHIFT) + 1) * 3 + (sourceY >> ETHER_BRICK_SIZE_SHIFT) + 1) * 3 +
+						(sourceZ >> ETHER_BRICK_SIZE_SHIFT) + 1;
+					EtherBrick *sourceBrick = sourceBricks[neighbour];
+					if (!sourceBrick)
+					{
+						continue;
+					}
+					int32_t sourceLinear = ((sourceX & localMask) * ETHER_BRICK_SIZE + (sourceY & localMask)) * ETHER_BRICK_SIZE + (sourceZ & localMask);
+					int32_t sourceIndexInBrick = s_brickMortonIndices[sourceLinear];
+					if (!(sourceBrick->m_photonMasks[IS_TIME_ODD][sourceIndexInBrick].load(std::memory_order_relaxed) & photonBit) ||
+						GetEtherType(sourceBrickCellIndices[neighbour] + sourceIndexInBrick) == EtherType::Observer) // observer cell holds photons for observers thread
+					{
+						continue;
+					}
+					int32_t destLinear = (posX * ETHER_BRICK_SIZE + posY) * ETHER_BRICK_SIZE + posZ;
+					masks[destLinear] |= photonBit;
+					if (rowCopy >= 0 && rowCopies[rowCopy].m_sourceBrick == sourceBrick)
+					{
+						rowCopies[rowCopy].m_count = (int16_t)(destLinear - rowCopies[rowCopy].m_destIndex + 1);
+					}
+					else
+					{
+						rowCopy = (int32_t)rowCopies.size();
+						rowCopies.push_back({ sourceBrick, (int16_t)slot, (int16_t)sourceLinear, (int16_t)destLinear, 1 });
 					}
-					MoveDaphniaToNextCell(pos, unitVector);
-					observer.m_position = nextPos;
-					SetNeedUpdateSimulationBoxes();
-				}
-			}
-			if (adminObserverId && (uint64_t)observer.m_observer != adminObserverId)
-			{
-				if (observer.m_observer->GetFirstSendToAdmin() || moveForward || moveBackward || observer.m_observer->GrabNewLatitude() || observer.m_observer->GrabNewLongitude())
-				{
-					observer.m_observer->SetFirstSendToAdmin(false);
-					MsgToAdminSomeObserverPosChanged msg;
-					msg.m_observerId = (uint64_t)observer.m_observer;
-					msg.m_pos = observer.m_position;
-					msg.m_latitude = observer.m_observer->GetLatitude();
-					msg.m_longitude = observer.m_observer->GetLongitude();
-					SendClientMsg((PPh::Observer*)adminObserverId, msg, sizeof(MsgToAdminSomeObserverPosChanged));
 				}
 			}
 		}
-		if (m_bSimulateNearObserver && s_bNeedUpdateSimulationBoxes)
+	}
+
+	EtherBrick *destBrick = GetEtherBrick(brickCellIndex);
+	if (!destBrick)
+	{
+		if (rowCopies.empty())
 		{
-			AdjustSimulationBoxes();
+			return;
 		}
-			
-		if (GetTimeMs() - lastTime >= 1000 && s_time > 0)
+		destBrick = AllocateEtherBrick(brickCellIndex);
+		if (!destBrick)
 		{
-			m_quantumOfTimePerSecond = (uint32_t)(s_time - lastTimeUniverse);
-#ifdef HIGH_PRECISION_STATS
-			for (int ii = 0; ii < m_timingsUniverseThreads.size(); ++ii)
-			{
-				if (m_timingsUniverseThreads[ii] > 0)
-				{
-					m_TickTimeMusAverageUniverseThreads[ii] = m_timingsUniverseThreads[ii] / m_quantumOfTimePerSecond;
-					m_timingsUniverseThreads[ii] = 0;
-				}
-			}
-			if (m_timingsObserverThread > 0)
-			{
-				m_TickTimeMusAverageObserverThread = m_timingsObserverThread / m_quantumOfTimePerSecond;
-				m_timingsObserverThread = 0;
-			}
-#endif
-			lastTime = GetTimeMs();
-			lastTimeUniverse = s_time;
+			return;
 		}
-		++s_time;
 	}
-	observersThread.join();
-	for (int ii = 0; ii < m_threadsCount; ++ii)
+	for (const PlaneRowCopy &rowCopy : rowCopies)
 	{
-		threads[ii].join();
+		memcpy(&GetEtherPlanePhoton(destBrick, IS_NEXT_TIME_ODD, rowCopy.m_slot, rowCopy.m_destIndex),
+			&GetEtherPlanePhoton(rowCopy.m_sourceBrick, IS_TIME_ODD, rowCopy.m_slot, rowCopy.m_sourceIndex), rowCopy.m_count * sizeof(Photon));
 	}
-	if (s_socketForNewClient != -1)
+	for (int32_t posX = cellsMin.m_posX; posX < cellsMax.m_posX; ++posX)
 	{
-		closesocket(s_socketForNewClient);
+		for (int32_t posY = cellsMin.m_posY; posY < cellsMax.m_posY; ++posY)
+		{
+			for (int32_t posZ = cellsMin.m_posZ; posZ < cellsMax.m_posZ; ++posZ)
+			{
+				int32_t linearIndex = (posX * ETHER_BRICK_SIZE + posY) * ETHER_BRICK_SIZE + posZ;
+				destBrick->m_photonMasks[IS_NEXT_TIME_ODD][s_brickMortonIndices[linearIndex]].store(masks[linearIndex], std::memory_order_relaxed);
+			}
+		}
+	}
+	if (!rowCopies.empty() && destBrick->m_lastEmitTime.load(std::memory_order_relaxed) != emitTime)
+	{
+		destBrick->m_lastEmitTime.store(emitTime, std::memory_order_relaxed);
 	}
 }
 
-void StopSimulation()
+// brickFunc(brickCellIndex, brickPos) is called for every brick which intersects bounds
+template<class BrickFunc>
+__forceinline void SweepBoundsBricks(const BoxIntMath &bounds, BrickFunc brickFunc)
+{
+	if (bounds.m_minVector.m_posX >= bounds.m_maxVector.m_posX || bounds.m_minVector.m_posY >= bounds.m_maxVector.m_posY ||
+		bounds.m_minVector.m_posZ >= bounds.m_maxVector.m_posZ)
+	{
+		return;
+	}
+	VectorInt32Math minBrick(bounds.m_minVector.m_posX >> ETHER_BRICK_SIZE_SHIFT, bounds.m_minVector.m_posY >> ETHER_BRICK_SIZE_SHIFT,
+		bounds.m_minVector.m_posZ >> ETHER_BRICK_SIZE_SHIFT);
+	VectorInt32Math maxBrick((bounds.m_maxVector.m_posX - 1) >> ETHER_BRICK_SIZE_SHIFT, (bounds.m_maxVector.m_posY - 1) >> ETHER_BRICK_SIZE_SHIFT,
+		(bounds.m_maxVector.m_posZ - 1) >> ETHER_BRICK_SIZE_SHIFT);
+	for (int32_t brickX = minBrick.m_posX; brickX <= maxBrick.m_posX; ++brickX)
+	{
+		for (int32_t brickY = minBrick.m_posY; brickY <= maxBrick.m_posY; ++brickY)
+		{
+			for (int32_t brickZ = minBrick.m_posZ; brickZ <= maxBrick.m_posZ; ++brickZ)
+			{
+				VectorInt32Math brickPos(brickX << ETHER_BRICK_SIZE_SHIFT, brickY << ETHER_BRICK_SIZE_SHIFT, brickZ << ETHER_BRICK_SIZE_SHIFT);
+				brickFunc(GetCellIndex(brickPos), brickPos);
+			}
+		}
+	}
+}
+
+// bounds are swept brick by brick, bricks rejected by brickFilter(brickCellIndex, brickPos) are skipped
+template<class BrickFilter, class CellFunc>
+__forceinline void SweepBounds(const BoxIntMath &bounds, BrickFilter brickFilter, CellFunc cellFunc)
+{
+	SweepBoundsBricks(bounds, [&bounds, &brickFilter, &cellFunc](int32_t brickCellIndex, const VectorInt32Math &brickPos)
+	{
+		if (!brickFilter(brickCellIndex, brickPos))
+		{
+			return;
+		}
+		bool isBrickInBounds = bounds.m_minVector.m_posX <= brickPos.m_posX && brickPos.m_posX + ETHER_BRICK_SIZE <= bounds.m_maxVector.m_posX &&
+			bounds.m_minVector.m_posY <= brickPos.m_posY && brickPos.m_posY + ETHER_BRICK_SIZE <= bounds.m_maxVector.m_posY &&
+			bounds.m_minVector.m_posZ <= brickPos.m_posZ && brickPos.m_posZ + ETHER_BRICK_SIZE <= bounds.m_maxVector.m_posZ;
+		// memory order inside brick
+		for (int32_t indexInBrick = 0; indexInBrick < ETHER_BRICK_CELLS; ++indexInBrick)
+		{
+			VectorInt32Math pos = brickPos + s_brickCellPositions[indexInBrick];
+			if (!isBrickInBounds && (pos.m_posX < bounds.m_minVector.m_posX || pos.m_posX >= bounds.m_maxVector.m_posX ||
+				pos.m_posY < bounds.m_minVector.m_posY || pos.m_posY >= bounds.m_maxVector.m_posY ||
+				pos.m_posZ < bounds.m_minVector.m_posZ || pos.m_posZ >= bounds.m_maxVector.m_posZ))
+			{
+				continue;
+			}
+			cellFunc(pos, brickCellIndex + indexInBrick);
+		}
+	});
+}
+
+__forceinline bool IsEtherBrickResident(int32_t brickCellIndex, const VectorInt32Math &brickPos)
+{
+	return GetEtherBrick(brickCellIndex) != nullptr;
+}
+
+// brick may get photons from itself and 26 neighbour bricks
+__forceinline bool IsEtherBrickReachable(int32_t brickCellIndex, const VectorInt32Math &brickPos)
+{
+	VectorInt32Math brick(brickPos.m_posX >> ETHER_BRICK_SIZE_SHIFT, brickPos.m_posY >> ETHER_BRICK_SIZE_SHIFT, brickPos.m_posZ >> ETHER_BRICK_SIZE_SHIFT);
+	for (int32_t brickX = std::max(brick.m_posX - 1, 0); brickX <= std::min(brick.m_posX + 1, s_bricksSize.m_posX - 1); ++brickX)
+	{
+		for (int32_t brickY = std::max(brick.m_posY - 1, 0); brickY <= std::min(brick.m_posY + 1, s_bricksSize.m_posY - 1); ++brickY)
+		{
+			for (int32_t brickZ = std::max(brick.m_posZ - 1, 0); brickZ <= std::min(brick.m_posZ + 1, s_bricksSize.m_posZ - 1); ++brickZ)
+			{
+				if (s_etherBricks[brickX * s_bricksStrideX + brickY * s_bricksStrideY + brickZ].load(std::memory_order_relaxed))
+				{
+					return true;
+				}
+			}
+		}
+	}
+	return false;
+}
+
+// Thread which takes tile or slab depends on timing and count of active threads, so it draws random bytes from own stream
+// keyed by item and quantum of time. Seeded run doesn't depend on threads then
+void InitItemRandom(uint32_t streamId)
+{
+	t_randomStream.Init(GetRandomSeed(), streamId, s_time.load(std::memory_order_relaxed) << 32);
+}
+
+// itemFunc(index) is called for every index of pass which current thread takes, queueItems(queue) gives indices of pass in queue
+template<class QueueItems, class ItemFunc>
+void TakeSimulationTileItems(int32_t threadNum, int32_t pass, QueueItems queueItems, ItemFunc itemFunc)
+{
+	RandomStream threadRandomStream = t_randomStream;
+	for (int32_t offset = 0; offset < m_threadsCount; ++offset)
+	{
+		SimulationTileQueue &tileQueue = s_simulationTileQueues[(threadNum + offset) % m_threadsCount]; // own slab first
+		const std::vector<int32_t> &items = queueItems(tileQueue);
+		for (int32_t next = tileQueue.m_nextTiles[pass]++; next < (int32_t)items.size(); next = tileQueue.m_nextTiles[pass]++)
+		{
+			InitItemRandom(TILE_RANDOM_STREAMS | (pass << 24) | items[next]);
+			itemFunc(items[next]);
+		}
+	}
+	t_randomStream = threadRandomStream;
+}
+
+// tileFunc(tile) is called for every tile of pass which current thread takes
+template<class TileFunc>
+void ProcessSimulationTiles(int32_t threadNum, int32_t pass, TileFunc tileFunc)
+{
+	TakeSimulationTileItems(threadNum, pass, [pass](const SimulationTileQueue &tileQueue) -> const std::vector<int32_t>& { return tileQueue.m_tiles[pass % 2]; },
+		[&tileFunc](int32_t tileIndex) { tileFunc(s_simulationTiles[tileIndex]); });
+}
+
+// edgeFunc(edge) is called for every tile edge which current thread takes
+template<class EdgeFunc>
+void ProcessSimulationTileEdges(int32_t threadNum, int32_t pass, EdgeFunc edgeFunc)
+{
+	TakeSimulationTileItems(threadNum, pass, [](const SimulationTileQueue &tileQueue) -> const std::vector<int32_t>& { return tileQueue.m_edges; },
+		[&edgeFunc](int32_t edgeIndex) { edgeFunc(s_simulationTileEdges[edgeIndex]); });
+}
+
+// every cell gets photons from one thread in a pass, so all threads emit directly
+template<uint32_t UNIVERSE_SCALE, SimulationEngine ENGINE, int32_t IS_TIME_ODD>
+void SimulateTiles(int32_t threadNum, uint64_t emitTime)
+{
+	t_directEmitMinX = 0;
+	t_directEmitMaxX = m_universeSize.m_posX;
+	auto simulateTile = [emitTime](const SimulationTile &tile)
+	{
+		for (const BoxIntMath &bounds : tile.m_boxes)
+		{
+			SweepBounds(bounds, IsEtherBrickResident, [emitTime](const VectorInt32Math &pos, int32_t cellIndex)
+			{
+				SimulateCell<UNIVERSE_SCALE, ENGINE, IS_TIME_ODD>(pos, cellIndex, emitTime);
+			});
+		}
+	};
+	ProcessSimulationTiles(threadNum, 0, simulateTile);
+	WaitAllUniverseThreads(s_firstPassThreadsCount);
+	ProcessSimulationTiles(threadNum, 1, simulateTile);
+}
+
+// steps cells of tile in X [minX; maxX)
+template<uint32_t UNIVERSE_SCALE, int32_t IS_TIME_ODD>
+void SimulateTileSlice(const SimulationTile &tile, int32_t minX, int32_t maxX, uint64_t emitTime)
+{
+	for (const BoxIntMath &box : tile.m_boxes)
+	{
+		BoxIntMath bounds = box;
+		bounds.m_minVector.m_posX = std::max(bounds.m_minVector.m_posX, minX);
+		bounds.m_maxVector.m_posX = std::min(bounds.m_maxVector.m_posX, maxX);
+		if (bounds.m_minVector.m_posX < bounds.m_maxVector.m_posX)
+		{
+			SweepBounds(bounds, IsEtherBrickResident, [emitTime](const VectorInt32Math &pos, int32_t cellIndex)
+			{
+				SimulateCell<UNIVERSE_SCALE, SimulationEngine::BoxSweep, IS_TIME_ODD>(pos, cellIndex, emitTime);
+			});
+		}
+	}
+}
+
+template<uint32_t UNIVERSE_SCALE>
+void SimulateTileSlice(const SimulationTile &tile, int32_t minX, int32_t maxX, uint64_t emitTime)
+{
+	(emitTime - 1) % 2 ? SimulateTileSlice<UNIVERSE_SCALE, 1>(tile, minX, maxX, emitTime) : SimulateTileSlice<UNIVERSE_SCALE, 0>(tile, minX, maxX, emitTime);
+}
+
+// Epoch of quantums of time (time; time + s_epochTicks]. Trapezoid of tile emits directly to its next layer only, the rest lands
+// around edges and waits in tile until edge is taken. Inverted trapezoids of edges emit directly, they never meet each other
+template<uint32_t UNIVERSE_SCALE>
+void SimulateEpochTiles(int32_t threadNum, uint64_t time)
+{
+	auto simulateTrapezoid = [time](SimulationTile &tile)
+	{
+		std::vector<HaloPhoton> &haloPhotons = s_haloPhotons[t_threadIndex].m_photons;
+		for (int32_t tick = 0; tick < s_epochTicks; ++tick)
+		{
+			bool isLastTick = tick == s_epochTicks - 1; // photons for next epoch, trapezoids of other tiles are far enough
+			t_directEmitMinX = isLastTick ? 0 : tile.m_minX + tick + 1;
+			t_directEmitMaxX = isLastTick ? m_universeSize.m_posX : tile.m_maxX - tick - 1;
+			size_t haloBegin = haloPhotons.size();
+			SimulateTileSlice<UNIVERSE_SCALE>(tile, tile.m_minX + tick, tile.m_maxX - tick, time + tick + 1);
+			if (isLastTick)
+			{
+				break;
+			}
+			size_t haloEnd = haloBegin;
+			for (size_t ii = haloBegin; ii < haloPhotons.size(); ++ii)
+			{
+				const HaloPhoton &haloPhoton = haloPhotons[ii];
+				if (GetEtherType(haloPhoton.m_cellIndex) == EtherType::Observer)
+				{
+					haloPhotons[haloEnd++] = haloPhoton;
+				}
+				else
+				{
+					int32_t edge = haloPhoton.m_posX - tile.m_minX < tile.m_maxX - haloPhoton.m_posX ? 0 : 1;
+					tile.m_edgePhotons[edge][tick + 1].push_back(haloPhoton);
+				}
+			}
+			haloPhotons.resize(haloEnd);
+		}
+	};
+	auto simulateInvertedTrapezoid = [time](const SimulationTileEdge &edge)
+	{
+		for (int32_t tick = 1; tick < s_epochTicks; ++tick)
+		{
+			uint64_t landingTime = time + tick;
+			for (int32_t side = 0; side < 2; ++side)
+			{
+				int32_t tileIndex = side ? edge.m_rightTile : edge.m_leftTile;
+				if (tileIndex < 0)
+				{
+					continue;
+				}
+				std::vector<HaloPhoton> &landingPhotons = s_simulationTiles[tileIndex].m_edgePhotons[1 - side][tick];
+				for (const HaloPhoton &landingPhoton : landingPhotons)
+				{
+					landingTime % 2 ?
+						WriteEtherPhoton<SimulationEngine::BoxSweep, 1, true>(landingPhoton.m_posX, landingPhoton.m_cellIndex, landingPhoton.m_cellPhotonIndex, landingPhoton.m_photon, landingTime) :
+						WriteEtherPhoton<SimulationEngine::BoxSweep, 0, true>(landingPhoton.m_posX, landingPhoton.m_cellIndex, landingPhoton.m_cellPhotonIndex, landingPhoton.m_photon, landingTime);
+				}
+				landingPhotons.clear();
+			}
+			if (edge.m_leftTile >= 0)
+			{
+				SimulateTileSlice<UNIVERSE_SCALE>(s_simulationTiles[edge.m_leftTile], edge.m_posX - tick, edge.m_posX, landingTime + 1);
+			}
+			if (edge.m_rightTile >= 0)
+			{
+				SimulateTileSlice<UNIVERSE_SCALE>(s_simulationTiles[edge.m_rightTile], edge.m_posX, edge.m_posX + tick, landingTime + 1);
+			}
+		}
+	};
+	ProcessSimulationTiles(threadNum, 0, simulateTrapezoid);
+	ProcessSimulationTiles(threadNum, 1, simulateTrapezoid);
+	WaitAllUniverseThreads(s_firstPassThreadsCount);
+	t_directEmitMinX = 0;
+	t_directEmitMaxX = m_universeSize.m_posX;
+	ProcessSimulationTileEdges(threadNum, 2, simulateInvertedTrapezoid);
+}
+
+// photons are written only to cells of taken tiles, threads wait each other between passes
+template<uint32_t UNIVERSE_SCALE, SimulationEngine ENGINE, int32_t IS_TIME_ODD>
+void GatherTiles(int32_t threadNum, uint64_t emitTime)
+{
+	auto scatterTile = [](const SimulationTile &tile)
+	{
+		for (const BoxIntMath &bounds : tile.m_boxes)
+		{
+			SweepBounds(bounds, IsEtherBrickResident, [](const VectorInt32Math &pos, int32_t cellIndex)
+			{
+				ScatterCell<UNIVERSE_SCALE, IS_TIME_ODD>(pos, cellIndex);
+			});
+		}
+	};
+	ProcessSimulationTiles(threadNum, 0, scatterTile);
+	ProcessSimulationTiles(threadNum, 1, scatterTile);
+	WaitAllUniverseThreads(s_firstPassThreadsCount);
+	auto gatherTile = [emitTime](const SimulationTile &tile)
+	{
+		for (const BoxIntMath &bounds : tile.m_boxes)
+		{
+			if constexpr (ENGINE == SimulationEngine::Streaming)
+			{
+				SweepBoundsBricks(bounds, [&bounds, emitTime](int32_t brickCellIndex, const VectorInt32Math &brickPos)
+				{
+					if (IsEtherBrickReachable(brickCellIndex, brickPos))
+					{
+						StreamBrick<IS_TIME_ODD>(brickCellIndex, brickPos, bounds, emitTime);
+					}
+				});
+			}
+			else
+			{
+				SweepBounds(bounds, IsEtherBrickReachable, [emitTime](const VectorInt32Math &pos, int32_t cellIndex)
+				{
+					GatherCell<IS_TIME_ODD>(pos, cellIndex, emitTime);
+				});
+			}
+		}
+	};
+	ProcessSimulationTiles(threadNum, 2, gatherTile);
+	ProcessSimulationTiles(threadNum, 3, gatherTile);
+}
+
+// photons of far cells in thread bounds are stepped for whole far field period, both quantum of time parities are taken
+// because photons from near boxes come to far cells in any quantum of time
+template<uint32_t UNIVERSE_SCALE>
+void SimulateFarBounds(const BoxIntMath &bounds, uint64_t emitTime)
+{
+	uint32_t weakening = GetPhotonWeakening<UNIVERSE_SCALE>();
+	PhotonWheel &photonWheel = s_photonWheels[t_threadIndex];
+	SweepBounds(bounds, IsEtherBrickResident, [&](const VectorInt32Math &pos, int32_t cellIndex)
+	{
+		if (IsPosSimulated(pos) || GetEtherType(cellIndex) == EtherType::Observer)
+		{
+			return;
+		}
+		for (int32_t isTimeOdd = 0; isTimeOdd < 2; ++isTimeOdd)
+		{
+			std::atomic<uint32_t> &photonsMask = GetEtherPhotonsMask(cellIndex, isTimeOdd);
+			uint32_t mask = photonsMask.load(std::memory_order_relaxed);
+			photonsMask.store(0, std::memory_order_relaxed);
+			for (; mask; mask &= mask - 1)
+			{
+				Photon photon = GetEtherPhoton(cellIndex, isTimeOdd, CountTrailingZeros(mask));
+				VectorInt32Math curPos = pos;
+				int32_t curCellIndex = cellIndex;
+				for (uint32_t step = 1; ReflectAndWeakenPhoton(curCellIndex, photon, weakening); ++step)
+				{
+					VectorInt8Math shift = PhotonKernel::StepPhoton(m_photonStepMode, photon);
+					VectorInt32Math unitVector(shift.m_posX, shift.m_posY, shift.m_posZ);
+					curPos = curPos + unitVector;
+					if (!IsPosInBounds(curPos))
+					{
+						break;
+					}
+					curCellIndex = GetCellIndex(curPos);
+					if (step == s_farFieldPeriod || IsPosSimulated(curPos) || GetEtherType(curCellIndex) == EtherType::Observer)
+					{
+						photonWheel.m_photons[(emitTime - 1 + step) % PHOTON_WHEEL_SIZE].push_back(
+							{ curPos.m_posX, curCellIndex, (int32_t)GetCellPhotonIndex(unitVector), photon });
+						break;
+					}
+				}
+			}
+		}
+	});
+}
+
+template<uint32_t UNIVERSE_SCALE, SimulationEngine ENGINE, int32_t IS_TIME_ODD>
+void SimulateActiveCells(int32_t threadNum, uint64_t emitTime)
+{
+	for (ActiveCells &activeCells : s_activeCells[threadNum])
+	{
+		std::vector<int32_t> &cellIndices = activeCells.m_cellIndices[IS_TIME_ODD];
+		for (int32_t cellIndex : cellIndices)
+		{
+			SimulateCell<UNIVERSE_SCALE, ENGINE, IS_TIME_ODD>(GetCellPos(cellIndex), cellIndex, emitTime);
+		}
+		cellIndices.clear();
+	}
+}
+
+template<uint32_t UNIVERSE_SCALE, SimulationEngine ENGINE, int32_t IS_TIME_ODD>
+void UniverseTick(int32_t threadNum, uint64_t emitTime)
+{
+	// neighbour threads emit to edge X layers of slab, nobody else emits outside of first and last slabs
+	const BoxIntMath &bounds = s_threadSimulateBounds[threadNum];
+	t_directEmitMinX = threadNum == 0 ? 0 : bounds.m_minVector.m_posX + 1;
+	t_directEmitMaxX = threadNum == m_threadsCount - 1 ? m_universeSize.m_posX : bounds.m_maxVector.m_posX - 1;
+	if constexpr (ENGINE == SimulationEngine::ActivePhotons)
+	{
+		SimulateActiveCells<UNIVERSE_SCALE, ENGINE, IS_TIME_ODD>(threadNum, emitTime);
+	}
+	else if constexpr (ENGINE == SimulationEngine::Gather || ENGINE == SimulationEngine::Streaming)
+	{
+		GatherTiles<UNIVERSE_SCALE, ENGINE, IS_TIME_ODD>(threadNum, emitTime);
+	}
+	else if (s_epochTicks > 1)
+	{
+		SimulateEpochTiles<UNIVERSE_SCALE>(threadNum, emitTime - 1);
+	}
+	else
+	{
+		if (s_farFieldPeriod && (emitTime - 1) % s_farFieldPeriod == 0)
+		{
+			RandomStream threadRandomStream = t_randomStream;
+			for (int32_t slab = threadNum; slab < m_threadsCount; slab += s_activeThreadsCount) // slabs of parked threads too
+			{
+				InitItemRandom(FAR_SLAB_RANDOM_STREAMS | slab);
+				SimulateFarBounds<UNIVERSE_SCALE>(s_threadFarBounds[slab], emitTime);
+			}
+			t_randomStream = threadRandomStream;
+			WaitAllUniverseThreads(s_farSteppedThreadsCount); // near boxes emit to far cells
+		}
+		SimulateTiles<UNIVERSE_SCALE, ENGINE, IS_TIME_ODD>(threadNum, emitTime);
+	}
+}
+
+typedef void(*UniverseTickFunc)(int32_t threadNum, uint64_t emitTime);
+template<SimulationEngine ENGINE>
+const std::array<std::array<UniverseTickFunc, 2>, MAX_SPECIALIZED_SCALE + 1> UNIVERSE_TICKS = { {
+	{ UniverseTick<0, ENGINE, 0>, UniverseTick<0, ENGINE, 1> },
+	{ UniverseTick<1, ENGINE, 0>, UniverseTick<1, ENGINE, 1> },
+	{ UniverseTick<2, ENGINE, 0>, UniverseTick<2, ENGINE, 1> },
+	{ UniverseTick<3, ENGINE, 0>, UniverseTick<3, ENGINE, 1> },
+	{ UniverseTick<4, ENGINE, 0>, UniverseTick<4, ENGINE, 1> }
+} };
+std::array<UniverseTickFunc, 2> s_universeTicks; // for quantum of time parity
+
+void SelectUniverseTicks()
+{
+	uint32_t specializedScale = m_universeScale <= MAX_SPECIALIZED_SCALE ? m_universeScale : 0;
+	switch (m_simulationEngine)
+	{
+	case SimulationEngine::ActivePhotons:
+		s_universeTicks = UNIVERSE_TICKS<SimulationEngine::ActivePhotons>[specializedScale];
+		break;
+	case SimulationEngine::Gather:
+		s_universeTicks = UNIVERSE_TICKS<SimulationEngine::Gather>[specializedScale];
+		break;
+	case SimulationEngine::Streaming:
+		s_universeTicks = UNIVERSE_TICKS<SimulationEngine::Streaming>[specializedScale];
+		break;
+	default:
+		s_universeTicks = UNIVERSE_TICKS<SimulationEngine::BoxSweep>[specializedScale];
+		break;
+	}
+}
+
+void UniverseThread(int32_t threadNum)
+{
+	t_threadIndex = threadNum;
+	if (threadNum != 0)
+	{ // zero thread actually running in simulation thread and initialized in Init and StartSimulation
+		InitThreadRandom(threadNum);
+		if (s_bPinThreads)
+		{
+			PinThreadToCpu(GetCurrentThread(), s_threadCpus[threadNum]);
+		}
+		else if (s_bNumaPlacement)
+		{
+			BindThreadToNumaNode(s_threadNumaNodes[threadNum]);
+		}
+	}
+	while (m_isSimulationRunning)
+	{
+		uint64_t time = s_time;
+		if (threadNum >= s_activeThreadsCount)
+		{ // thread left in this quantum of time, so simulation thread still waits for it once
+			ArriveAtTickBarrier();
+			if (!ParkUniverseThread(threadNum, time))
+			{
+				return;
+			}
+			continue;
+		}
+#ifdef HIGH_PRECISION_STATS
+		auto beginTime = std::chrono::high_resolution_clock::now();
+#endif
+		int isTimeOdd = time % 2;
+		s_universeTicks[isTimeOdd](threadNum, time + 1);
+#ifdef HIGH_PRECISION_STATS
+		auto endTime = std::chrono::high_resolution_clock::now();
+		auto dif = endTime - beginTime;
+		m_timingsUniverseThreads[threadNum] += (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(dif).count();
+#endif
+		if (threadNum == 0)
+		{ // zero thread actually running in simulation thread
+			break;
+		}
+		ArriveAtTickBarrier();
+		WaitNextQuantumOfTime(time);
+	}
+	ArriveAtTickBarrier();
+}
+
+const VectorInt32Math & GetUniverseSize()
+{
+	return m_universeSize;
+}
+
+// box of every observer is bounded by directions its eye looks to, overlapping boxes are merged.
+// Threads get X slabs of union of boxes with equal count of cells
+void AdjustSimulationBoxes()
+{
+	if (!s_observers.size())
+	{
+		return;
+	}
+
+	std::vector<BoxIntMath> boxes;
+	for (const ObserverCell &observerCell : s_observers)
+	{
+		const Observer *observer = observerCell.m_observer;
+		VectorInt32Math observerPos = observerCell.m_position;
+
+		VectorInt32Math boundsMin;
+		{
+			VectorInt32Math boundSize(GetSimulationSize(), GetSimulationSize(), GetSimulationSize());
+			const VectorInt32Math &orientMinChanger = observer->GetOrientMinChanger();
+			boundSize.m_posX = std::min(boundSize.m_posX, orientMinChanger.m_posX);
+			boundSize.m_posY = std::min(boundSize.m_posY, orientMinChanger.m_posY);
+			boundSize.m_posZ = std::min(boundSize.m_posZ, orientMinChanger.m_posZ);
+			boundsMin = observerPos - boundSize;
+			AdjustSizeByBounds(boundsMin);
+		}
+
+		VectorInt32Math boundsMax;
+		{
+			VectorInt32Math boundSize(GetSimulationSize(), GetSimulationSize(), GetSimulationSize());
+			const VectorInt32Math &orientMaxChanger = observer->GetOrientMaxChanger();
+			boundSize.m_posX = std::min(boundSize.m_posX, orientMaxChanger.m_posX);
+			boundSize.m_posY = std::min(boundSize.m_posY, orientMaxChanger.m_posY);
+			boundSize.m_posZ = std::min(boundSize.m_posZ, orientMaxChanger.m_posZ);
+			boundsMax = observerPos + boundSize + VectorInt32Math::OneVector; // [minVector; maxVector)
+			AdjustSizeByBounds(boundsMax);
+		}
+		boxes.push_back(BoxIntMath(boundsMin, boundsMax));
+	}
+
+	auto isOverlapped = [](const BoxIntMath &box, const BoxIntMath &other)
+	{
+		for (int32_t axis = 0; axis < 3; ++axis)
+		{
+			if (box.m_maxVector.m_posArray[axis] <= other.m_minVector.m_posArray[axis] || other.m_maxVector.m_posArray[axis] <= box.m_minVector.m_posArray[axis])
+			{
+				return false;
+			}
+		}
+		return true;
+	};
+	for (bool isMerged = true; isMerged;) // merged box may overlap boxes which were checked before
+	{
+		isMerged = false;
+		for (size_t ii = 0; ii < boxes.size() && !isMerged; ++ii)
+		{
+			for (size_t jj = ii + 1; jj < boxes.size() && !isMerged; ++jj)
+			{
+				if (isOverlapped(boxes[ii], boxes[jj]))
+				{
+					for (int32_t axis = 0; axis < 3; ++axis)
+					{
+						boxes[ii].m_minVector.m_posArray[axis] = std::min(boxes[ii].m_minVector.m_posArray[axis], boxes[jj].m_minVector.m_posArray[axis]);
+						boxes[ii].m_maxVector.m_posArray[axis] = std::max(boxes[ii].m_maxVector.m_posArray[axis], boxes[jj].m_maxVector.m_posArray[axis]);
+					}
+					boxes.erase(boxes.begin() + jj);
+					isMerged = true;
+				}
+			}
+		}
+	}
+
+	BoxIntMath boundingBox = boxes.front();
+	for (const BoxIntMath &box : boxes)
+	{
+		for (int32_t axis = 0; axis < 3; ++axis)
+		{
+			boundingBox.m_minVector.m_posArray[axis] = std::min(boundingBox.m_minVector.m_posArray[axis], box.m_minVector.m_posArray[axis]);
+			boundingBox.m_maxVector.m_posArray[axis] = std::max(boundingBox.m_maxVector.m_posArray[axis], box.m_maxVector.m_posArray[axis]);
+		}
+	}
+
+	// cells of boxes in every X layer of bounding box
+	std::vector<int64_t> layerCells(std::max(boundingBox.m_maxVector.m_posX - boundingBox.m_minVector.m_posX, 0), 0);
+	int64_t cellsCount = 0;
+	for (const BoxIntMath &box : boxes)
+	{
+		int64_t boxLayerCells = (int64_t)std::max(box.m_maxVector.m_posY - box.m_minVector.m_posY, 0) *
+			std::max(box.m_maxVector.m_posZ - box.m_minVector.m_posZ, 0);
+		for (int32_t posX = box.m_minVector.m_posX; posX < box.m_maxVector.m_posX; ++posX)
+		{
+			layerCells[posX - boundingBox.m_minVector.m_posX] += boxLayerCells;
+			cellsCount += boxLayerCells;
+		}
+	}
+
+	if (std::abs(cellsCount - s_activeThreadsVolume) * ADAPTIVE_THREADS_VOLUME_CHANGE > s_activeThreadsVolume)
+	{
+		std::fill(s_activeThreadsTickNs.begin(), s_activeThreadsTickNs.end(), 0);
+		s_activeThreadsVolume = cellsCount;
+	}
+
+	int32_t posXBegin = boundingBox.m_minVector.m_posX;
+	int64_t threadsCells = 0;
+	for (int ii = 0; ii < m_threadsCount; ++ii)
+	{
+		int32_t posXEnd = posXBegin;
+		int64_t threadCellsEnd = cellsCount * (ii + 1) / m_threadsCount;
+		while (posXEnd < boundingBox.m_maxVector.m_posX && (threadsCells < threadCellsEnd || ii == m_threadsCount - 1))
+		{
+			threadsCells += layerCells[posXEnd - boundingBox.m_minVector.m_posX];
+			++posXEnd;
+		}
+		s_threadSimulateBounds[ii] = BoxIntMath({ posXBegin, boundingBox.m_minVector.m_posY, boundingBox.m_minVector.m_posZ },
+			{ posXEnd, boundingBox.m_maxVector.m_posY, boundingBox.m_maxVector.m_posZ });
+		posXBegin = posXEnd;
+	}
+	s_simulateBoxes = std::move(boxes);
+	s_simulateBoundingBox = boundingBox;
+	BuildSimulationTiles();
+	s_bNeedUpdateSimulationBoxes = false;
+}
+
+void BuildSimulationTiles()
+{
+	s_simulationTiles.clear();
+	s_simulationTileEdges.clear();
+	for (int32_t ii = 0; ii < m_threadsCount; ++ii)
+	{
+		for (std::vector<int32_t> &tiles : s_simulationTileQueues[ii].m_tiles)
+		{
+			tiles.clear();
+		}
+		s_simulationTileQueues[ii].m_edges.clear();
+	}
+	// trapezoids of epoch don't meet inside of tile, inverted trapezoids of neighbour edges don't meet too
+	int32_t tileMinSize = std::max(SIMULATION_TILE_MIN_SIZE, 2 * s_epochTicks);
+	int32_t minX = s_simulateBoundingBox.m_minVector.m_posX;
+	int32_t maxX = s_simulateBoundingBox.m_maxVector.m_posX;
+	if (minX < maxX && maxX - minX < tileMinSize)
+	{ // tile may be wider than its boxes
+		maxX = std::min(minX + tileMinSize, m_universeSize.m_posX);
+		minX = maxX - tileMinSize;
+	}
+	int32_t tilesCount = m_threadsCount * SIMULATION_TILES_PER_THREAD;
+	int32_t tileSize = std::max(tileMinSize, (maxX - minX + tilesCount - 1) / tilesCount);
+	int32_t ownerThread = 0;
+	int32_t tileIndex = 0; // parity of tile, tiles without boxes are counted too
+	for (int32_t tileMinX = minX; tileMinX < maxX; ++tileIndex)
+	{
+		int32_t tileMaxX = maxX - (tileMinX + tileSize) < tileMinSize ? maxX : tileMinX + tileSize; // last tile takes remainder
+		SimulationTile tile;
+		tile.m_minX = tileMinX;
+		tile.m_maxX = tileMaxX;
+		if (s_epochTicks > 1)
+		{
+			for (std::vector<std::vector<HaloPhoton>> &edgePhotons : tile.m_edgePhotons)
+			{
+				edgePhotons.resize(s_epochTicks);
+			}
+		}
+		for (const BoxIntMath &box : s_simulateBoxes)
+		{
+			BoxIntMath tileBox = box;
+			tileBox.m_minVector.m_posX = std::max(tileBox.m_minVector.m_posX, tileMinX);
+			tileBox.m_maxVector.m_posX = std::min(tileBox.m_maxVector.m_posX, tileMaxX);
+			if (tileBox.m_minVector.m_posX < tileBox.m_maxVector.m_posX)
+			{
+				tile.m_boxes.push_back(tileBox);
+			}
+		}
+		if (!tile.m_boxes.empty())
+		{
+			while (ownerThread < m_threadsCount - 1 && s_threadSimulateBounds[ownerThread].m_maxVector.m_posX <= tileMinX)
+			{
+				++ownerThread;
+			}
+			int32_t simulationTileIndex = (int32_t)s_simulationTiles.size();
+			if (s_simulationTileEdges.empty() || s_simulationTileEdges.back().m_posX != tileMinX)
+			{
+				s_simulationTileQueues[ownerThread].m_edges.push_back((int32_t)s_simulationTileEdges.size());
+				s_simulationTileEdges.push_back({ tileMinX });
+			}
+			s_simulationTileEdges.back().m_rightTile = simulationTileIndex;
+			s_simulationTileQueues[ownerThread].m_edges.push_back((int32_t)s_simulationTileEdges.size());
+			s_simulationTileEdges.push_back({ tileMaxX, simulationTileIndex });
+			s_simulationTileQueues[ownerThread].m_tiles[tileIndex % 2].push_back(simulationTileIndex);
+			s_simulationTiles.push_back(std::move(tile));
+		}
+		tileMinX = tileMaxX;
+	}
+}
+
+int32_t ChooseActiveThreadsCount()
+{
+	int32_t count = s_activeThreadsCount;
+	uint64_t nextTime = s_time + s_epochTicks;
+	if (!s_bAdaptiveThreads || nextTime - s_activeThreadsPeriodTime < ADAPTIVE_THREADS_PERIOD)
+	{
+		return count;
+	}
+	auto time = std::chrono::high_resolution_clock::now();
+	if (s_activeThreadsPeriodTime)
+	{
+		s_activeThreadsTickNs[count] = std::max<uint64_t>(1, std::chrono::duration_cast<std::chrono::nanoseconds>(time - s_activeThreadsPeriodBeginTime).count() /
+			(nextTime - s_activeThreadsPeriodTime));
+	}
+	s_activeThreadsPeriodTime = nextTime;
+	s_activeThreadsPeriodBeginTime = time;
+	// go to faster measured neighbour, if current count is the fastest, probe neighbour which is not measured or is measured long ago
+	int32_t nextCount = count;
+	int32_t probeCount = count;
+	int32_t probeShift = (s_activeThreadsPeriodsCount / ADAPTIVE_THREADS_PROBE_PERIODS) % 2 ? 1 : -1; // probed neighbour alternates
+	bool isProbe = ++s_activeThreadsPeriodsCount % ADAPTIVE_THREADS_PROBE_PERIODS == 0;
+	for (int32_t neighbour : { count + probeShift, count - probeShift })
+	{
+		if (neighbour < 1 || m_threadsCount < neighbour)
+		{
+			continue;
+		}
+		if (!s_activeThreadsTickNs[neighbour] || isProbe)
+		{
+			probeCount = probeCount == count ? neighbour : probeCount;
+		}
+		else if (s_activeThreadsTickNs[neighbour] < s_activeThreadsTickNs[nextCount])
+		{
+			nextCount = neighbour;
+		}
+	}
+	if (nextCount == count)
+	{
+		nextCount = probeCount;
+	}
+	s_waitThreadsCount = std::max(count, nextCount) + 1; // threads which leave pass the barrier once more, observers thread
+	s_activeThreadsCount = nextCount;
+	return count;
+}
+
+void ResetSimulationTiles()
+{
+	for (int32_t ii = 0; ii < m_threadsCount; ++ii)
+	{
+		for (std::atomic<int32_t> &nextTile : s_simulationTileQueues[ii].m_nextTiles)
+		{
+			nextTile.store(0, std::memory_order_relaxed);
+		}
+	}
+}
+
+SOCKET s_socketForNewClient = -1;
+void CreateSocketForNewClient()
+{
+	if (s_observers.size() < CommonParams::MAX_CLIENTS)
+	{
+		// UDP
+		SOCKET socketS;
+		struct sockaddr_in local;
+		local.sin_family = AF_INET;
+		local.sin_port = htons(CommonParams::CLIENT_UDP_PORT_START + (u_short)s_observers.size());
+		local.sin_addr.s_addr = INADDR_ANY;
+		socketS = socket(AF_INET, SOCK_DGRAM, 0);
+		bind(socketS, (sockaddr*)&local, sizeof(local));
+		u_long mode = 1;  // 1 to enable non-blocking socket
+		ioctlsocket(socketS, FIONBIO, &mode);
+		s_socketForNewClient = socketS;
+	}
+	else
+	{
+		assert(s_socketForNewClient == -1);
+	}
+}
+
+void StartSimulation()
+{
+	// init sockets
+	WSADATA wsaData;
+	WSAStartup(MAKEWORD(2, 2), &wsaData);
+	CreateSocketForNewClient();
+	m_isSimulationRunning = true;
+
+
+		
+	// threads
+	std::vector<std::thread> threads;
+	threads.resize(m_threadsCount);
+
+	s_waitThreadsCount = 1; // observer thread only before first connection
+	t_threadIndex = 0;
+	if (s_bPinThreads)
+	{
+		PinThreadToCpu(GetCurrentThread(), s_threadCpus[0]);
+	}
+	else if (s_bNumaPlacement)
+	{
+		BindThreadToNumaNode(s_threadNumaNodes[0]);
+	}
+	std::thread observersThread = std::thread([]()
+	{
+		t_threadIndex = m_threadsCount;
+		InitThreadRandom(m_threadsCount);
+		if (s_bPinThreads)
+		{
+			PinThreadToCpu(GetCurrentThread(), s_threadCpus[m_threadsCount]);
+		}
+		while (m_isSimulationRunning)
+		{
+#ifdef HIGH_PRECISION_STATS
+			auto beginTime = std::chrono::high_resolution_clock::now();
+#endif
+			if (s_socketForNewClient != -1)
+			{
+				if (s_observers.empty())
+				{ // nothing to tick before first observer, thread sleeps in socket until client connects
+					fd_set readSockets;
+					FD_ZERO(&readSockets);
+					FD_SET(s_socketForNewClient, &readSockets);
+					timeval timeout = { 0, BARRIER_PARK_TIMEOUT_MS * 1000 };
+					select(0, &readSockets, nullptr, nullptr, &timeout);
+				}
+
+				char buffer[CommonParams::DEFAULT_BUFLEN];
+				struct sockaddr_in from;
+				int fromlen = sizeof(from);
+				while (recvfrom(s_socketForNewClient, buffer, sizeof(buffer), 0, (sockaddr*)&from, &fromlen) > 0)
+				{
+					if (const MsgCheckVersion *msg = QueryMessage<MsgCheckVersion>(buffer))
+					{
+						MsgCheckVersionResponse msgGetVersionResponse;
+						msgGetVersionResponse.m_observerId = 0;
+						if (msg->m_clientVersion == CommonParams::PROTOCOL_VERSION)
+						{
+							uint8_t observerIndex = (uint8_t)s_observers.size();
+							uint8_t eyeSize = 16;
+							if (msg->m_observerType == static_cast<uint8_t>(CommonParams::ObserverType::Daphnia8x8))
+							{
+								eyeSize = 8;
+							}
+							PPh::VectorInt32Math staticPos(102, 405, 61);
+							if (s_observers.size() == 1)
+							{
+								staticPos = PPh::VectorInt32Math(84, 405, 73);
+							}
+							if (InitEtherCell(staticPos, EtherType::Observer, EtherColor(255, 255, 255, observerIndex)))
+							{
+								s_observers.push_back(ObserverCell(new Observer(observerIndex, eyeSize), staticPos, s_socketForNewClient, from));
+								//s_observers.push_back(ObserverCell(new Observer(observerIndex, eyeSize), GetRandomEmptyCell(), s_socketForNewClient, from));
+								MoveDaphniaToNextCell(s_observers.back().m_position, VectorInt32Math::ZeroVector); // make Daphnia bigger
+								s_socketForNewClient = -1;
+								CreateSocketForNewClient();
+								msgGetVersionResponse.m_observerId = reinterpret_cast<uint64_t>(s_observers.back().m_observer);
+							}
+							else
+							{
+								printf("Client refused, no ether color for observer\n");
+							}
+						}
+						else
+						{
+							printf("Client refused with wrong protocol version. Server version: %d. Client version: %d\n", CommonParams::PROTOCOL_VERSION, msg->m_clientVersion);
+						}
+						msgGetVersionResponse.m_serverVersion = CommonParams::PROTOCOL_VERSION;
+						sendto(s_socketForNewClient, msgGetVersionResponse.GetBuffer(), sizeof(msgGetVersionResponse), 0, (sockaddr*)&from, fromlen);
+					}
+				}
+			}
+
+			uint64_t time = s_time;
+			if (s_bRayCastEcholocation)
+			{
+				DeliverEchoPhotons();
+			}
+			for (auto &observer : s_observers)
+			{
+				observer.m_observer->PPhTick(s_time);
+				//ClearReceivedPhotons(observer.m_observer);
+			}
+
+#ifdef HIGH_PRECISION_STATS
+			auto endTime = std::chrono::high_resolution_clock::now();
+			m_timingsObserverThread += (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(endTime - beginTime).count();
+#endif
+			ArriveAtTickBarrier();
+			WaitNextQuantumOfTime(time);
+		}
+		ArriveAtTickBarrier();
+	});
+
+	// wait first observer
+	while (m_isSimulationRunning)
+	{
+		WaitFor(s_waitThreadsCount, [](int32_t count) { return count == 0 || !m_isSimulationRunning; });
+		if (s_observers.size())
+		{
+			break;
+		}
+		s_waitThreadsCount = 1; // observer thread only before first connection
+		StartNextQuantumOfTime();
+	}
+
+	s_waitThreadsCount = m_threadsCount + 1; // universe threads and observers thread
+	ActivateVacatedCells();
+	StartNextQuantumOfTime();
+	UpdateCullingObserverPositions();
+	if (m_bSimulateNearObserver)
+	{
+		AdjustSimulationBoxes();
+	}
+	for (int ii = 1; ii < m_threadsCount && m_isSimulationRunning; ++ii)
+	{
+		threads[ii] = std::thread(UniverseThread, ii);
+	}
+
+	int64_t lastTime = GetTimeMs();
+	uint64_t lastTimeUniverse = 0;
+	while (m_isSimulationRunning)
+	{
+		UniverseThread(0);
+		WaitFor(s_waitThreadsCount, [](int32_t count) { return count == 0 || !m_isSimulationRunning; });
+		if (!m_isSimulationRunning)
+		{ // threads leaving after stop can arrive twice, they are joined below
+			break;
+		}
+		s_waitThreadsCount = s_activeThreadsCount + 1; // active universe threads and observers thread
+		s_firstPassThreadsCount = 0;
+		ResetSimulationTiles();
+		s_farSteppedThreadsCount = 0;
+		MergeHaloPhotons();
+		ReleaseEmptyEtherBricks();
+		uint64_t adminObserverId = m_adminObserverId.load(std::memory_order_relaxed);
+		for (ObserverCell &observer : s_observers)
+		{
+			bool moveForward = observer.m_observer->GrabMoveForward();
+			bool moveBackward = observer.m_observer->GrabMoveBackward();
+			if (moveForward || moveBackward)
+			{
+				assert(s_observers.size() > observer.m_observer->m_index);
+				VectorInt32Math pos = observer.m_position;
+				OrientationVectorMath orient = observer.m_observer->GetOrientation();
+				if (moveBackward)
+				{
+					orient *= -1;
+				}
+				VectorInt32Math unitVector = CalculatePositionShift(observer.m_position, orient);
+				VectorInt32Math nextPos = pos + unitVector;
+				VectorInt32Math outEatenCrumbPos = VectorInt32Math::ZeroVector;
+				if (CanDaphniaMoveToNextCell(pos, unitVector, outEatenCrumbPos))
+				{
+					if (outEatenCrumbPos != VectorInt32Math::ZeroVector)
+					{
+						VectorInt32Math crumbPos = DestroyCrumb(outEatenCrumbPos, true);
+						observer.m_observer->IncEatenCrumb(crumbPos);
+					}
+					MoveDaphniaToNextCell(pos, unitVector);
+					observer.m_position = nextPos;
+					observer.m_echoPhotonsMasks.fill(0); // like photons of body cells
+					SetNeedUpdateSimulationBoxes();
+				}
+			}
+			if (adminObserverId && (uint64_t)observer.m_observer != adminObserverId)
+			{
+				if (observer.m_observer->GetFirstSendToAdmin() || moveForward || moveBackward || observer.m_observer->GrabNewLatitude() || observer.m_observer->GrabNewLongitude())
+				{
+					observer.m_observer->SetFirstSendToAdmin(false);
+					MsgToAdminSomeObserverPosChanged msg;
+					msg.m_observerId = (uint64_t)observer.m_observer;
+					msg.m_pos = observer.m_position;
+					msg.m_latitude = observer.m_observer->GetLatitude();
+					msg.m_longitude = observer.m_observer->GetLongitude();
+					SendClientMsg((PPh::Observer*)adminObserverId, msg, sizeof(MsgToAdminSomeObserverPosChanged));
+				}
+			}
+		}
+		UpdateEmptyDistances();
+		UpdateCullingObserverPositions();
+		if (m_bSimulateNearObserver && s_bNeedUpdateSimulationBoxes)
+		{
+			AdjustSimulationBoxes();
+		}
+			
+		if (GetTimeMs() - lastTime >= 1000 && s_time > 0)
+		{
+			m_quantumOfTimePerSecond = (uint32_t)(s_time - lastTimeUniverse);
+#ifdef HIGH_PRECISION_STATS
+			for (int ii = 0; ii < m_timingsUniverseThreads.size(); ++ii)
+			{
+				m_TickTimeMusAverageUniverseThreads[ii] = m_timingsUniverseThreads[ii] / m_quantumOfTimePerSecond; // 0 for parked thread
+				m_timingsUniverseThreads[ii] = 0;
+			}
+			if (m_timingsObserverThread > 0)
+			{
+				m_TickTimeMusAverageObserverThread = m_timingsObserverThread / m_quantumOfTimePerSecond;
+				m_timingsObserverThread = 0;
+			}
+			for (int ii = 0; ii < s_barrierWaitTimes.size(); ++ii)
+			{
+				m_barrierWaitMusAverage[ii] = (uint32_t)(s_barrierWaitTimes[ii].m_mus / m_quantumOfTimePerSecond);
+				s_barrierWaitTimes[ii].m_mus = 0;
+			}
+#endif
+			m_culledPhotonStepsPerSecond = 0;
+			for (CulledPhotonSteps &culledPhotonSteps : s_culledPhotonSteps)
+			{
+				m_culledPhotonStepsPerSecond += culledPhotonSteps.m_count;
+				culledPhotonSteps.m_count = 0;
+			}
+			lastTime = GetTimeMs();
+			lastTimeUniverse = s_time;
+		}
+		int32_t prevActiveThreadsCount = ChooseActiveThreadsCount();
+		ActivateVacatedCells();
+		StartNextQuantumOfTime();
+		UnparkUniverseThreads(prevActiveThreadsCount);
+	}
+	observersThread.join();
+	for (std::thread &thread : threads)
+	{
+		if (thread.joinable()) // universe thread 0 is simulation thread, others are not started if simulation stops before first observer
+		{
+			thread.join();
+		}
+	}
+	if (s_socketForNewClient != -1)
+	{
+		closesocket(s_socketForNewClient);
+	}
+}
+
+void StopSimulation()
 {
 	m_isSimulationRunning = false;
 }
 
-bool IsSimulationRunning()
+bool IsSimulationRunning()
+{
+	return m_isSimulationRunning;
+}
+
+uint32_t GetCellPhotonIndex(const VectorInt32Math &unitVector)
+{
+	int32_t index = (unitVector.m_posX + 1) * 9 + (unitVector.m_posY + 1) * 3 + (unitVector.m_posZ + 1);
+	if (index > 13)
+	{
+		--index;
+	}
+	return index;
+}
+
+VectorInt32Math GetUnitVectorFromPhotonIndex(uint32_t index) // index [0;25]
+{
+	if (index > 12)
+	{
+		++index;
+	}
+	VectorInt32Math unitVector;
+	unitVector.m_posX = index / 9 - 1;
+	unitVector.m_posY = (index - (unitVector.m_posX + 1) * 9)  / 3 - 1;
+	unitVector.m_posZ = (index - (unitVector.m_posX + 1) * 9 - (unitVector.m_posY + 1) * 3) - 1;
+	return unitVector;
+}
+
+bool IsPosInBounds(const VectorInt32Math &pos)
+{
+	const VectorInt32Math &size = GetUniverseSize();
+	if (pos.m_posX < 0 || pos.m_posY < 0 || pos.m_posZ < 0)
+	{
+		return false;
+	}
+	if (pos.m_posX >= size.m_posX || pos.m_posY >= size.m_posY || pos.m_posZ >= size.m_posZ)
+	{
+		return false;
+	}
+	return true;
+}
+
+bool GetNextCrumb(VectorInt32Math & outCrumbPos, EtherColor & outCrumbColor)
+{
+	static int32_t s_posX = 0;
+	static int32_t s_posY = 0;
+	static int32_t s_posZ = 0;
+	bool bResult = false;
+	for (; s_posX < m_universeSize.m_posX; ++s_posX, s_posY=0)
+	{
+		for (; s_posY < m_universeSize.m_posY; ++s_posY, s_posZ=0)
+		{
+			for (; s_posZ < m_universeSize.m_posZ; ++s_posZ)
+			{
+				if (bResult)
+				{
+					break;
+				}
+				int32_t cellIndex = GetCellIndex(VectorInt32Math(s_posX, s_posY, s_posZ));
+				if (GetEtherType(cellIndex) == EtherType::Crumb)
+				{
+					if (s_posX && s_posY && s_posZ)
+					{
+						int32_t cellTypeX = GetEtherType(GetCellIndex(VectorInt32Math(s_posX - 1, s_posY, s_posZ)));
+						int32_t cellTypeY = GetEtherType(GetCellIndex(VectorInt32Math(s_posX, s_posY - 1, s_posZ)));
+						int32_t cellTypeZ = GetEtherType(GetCellIndex(VectorInt32Math(s_posX, s_posY, s_posZ - 1)));
+						if (cellTypeX == EtherType::Crumb || cellTypeY == EtherType::Crumb || cellTypeZ == EtherType::Crumb)
+						{
+							continue;
+						}
+					}
+					outCrumbPos = VectorInt32Math(s_posX, s_posY, s_posZ);
+					outCrumbColor = GetEtherColor(cellIndex);
+					bResult = true;
+				}
+			}
+			if (bResult)
+			{
+				break;
+			}
+		}
+		if (bResult)
+		{
+			break;
+		}
+	}
+	if (!bResult)
+	{
+		s_posX = 0;
+		s_posY = 0;
+		s_posZ = 0;
+	}
+	return bResult;
+}
+
+void SetAdminObserverId(uint64_t observerId)
+{
+	m_adminObserverId = observerId;
+}
+
+bool EmitEcholocationPhoton(const Observer *observer, const OrientationVectorMath &orientation, PhotonParam param)
+{
+	assert(s_observers.size() > observer->m_index);
+	VectorInt32Math pos = s_observers[observer->m_index].m_position;
+	Photon photon(orientation);
+	if (m_photonStepMode != PhotonKernel::StepMode::Random)
+	{
+		photon.m_stepPhase = t_randomStream.NextByte(); // random start of step pattern, Random mode doesn't draw it
+	}
+	photon.m_param = param;
+	photon.m_param2 = observer->m_index;
+	photon.m_color.m_colorA = 255;
+	if (IS_DAPHNIA_BIG)
+	{
+		VectorInt8Math unitVector = PhotonKernel::StepPhoton(m_photonStepMode, photon);
+		pos = pos + VectorInt32Math(unitVector.m_posX, unitVector.m_posY, unitVector.m_posZ);
+	}
+	if (s_bRayCastEcholocation)
+	{
+		return RayCastEcholocationPhoton(observer->m_index, pos, photon);
+	}
+	return EmitPhoton(pos, photon);
+}
+
+// Photon emitted from pos is stepped, reflected and weakened like in ether, but all at once and only against geometry.
+// Moving daphnias and eaten crumbs are seen as they are at emission
+bool RayCastEcholocationPhoton(uint8_t observerIndex, const VectorInt32Math &pos, Photon photon)
+{
+	const VectorInt32Math &observerPos = s_observers[observerIndex].m_position;
+	int32_t bodyRadius = IS_DAPHNIA_BIG ? 1 : 0; // photons are received by shell of big daphnia
+	uint32_t weakening = GetPhotonWeakening();
+	uint64_t emitTime = s_time + 1;
+	VectorInt8Math shift = PhotonKernel::StepPhoton(m_photonStepMode, photon);
+	VectorInt32Math unitVector(shift.m_posX, shift.m_posY, shift.m_posZ);
+	VectorInt32Math curPos = pos + unitVector;
+	for (int32_t ii = 0; ii < ECHO_MARCH_MAX_STEPS && IsPosInBounds(curPos); ++ii)
+	{
+		int32_t cellIndex = GetCellIndex(curPos);
+		int32_t cellType = GetEtherType(cellIndex);
+		VectorInt32Math bodyShift = curPos - observerPos;
+		int32_t bodyDistance = std::max(std::abs(bodyShift.m_posX), std::max(std::abs(bodyShift.m_posY), std::abs(bodyShift.m_posZ)));
+		if (cellType == EtherType::Observer && bodyDistance == bodyRadius)
+		{
+			uint8_t bodyCellIndex = IS_DAPHNIA_BIG ? (uint8_t)GetCellPhotonIndex(bodyShift) : 0;
+			s_echoPhotonsWheel[(emitTime + ii) % ECHO_WHEEL_SIZE].push_back({ observerIndex, bodyCellIndex, (uint8_t)GetCellPhotonIndex(unitVector), photon });
+			return true;
+		}
+		if (!ReflectAndWeakenPhoton(cellIndex, photon, weakening))
+		{
+			return true;
+		}
+		shift = PhotonKernel::StepPhoton(m_photonStepMode, photon);
+		unitVector = VectorInt32Math(shift.m_posX, shift.m_posY, shift.m_posZ);
+		curPos = curPos + unitVector;
+	}
+	return true;
+}
+
+// ray-cast photons which reached body since previous observers tick take slots of body cells, collision policy is the same as in ether
+void DeliverEchoPhotons()
+{
+	for (uint64_t tick = 0; tick < (uint64_t)s_epochTicks && tick <= s_time; ++tick)
+	{
+		std::vector<EchoPhoton> &echoPhotons = s_echoPhotonsWheel[(s_time - tick) % ECHO_WHEEL_SIZE];
+		for (const EchoPhoton &echoPhoton : echoPhotons)
+		{
+			ObserverCell &observer = s_observers[echoPhoton.m_observerIndex];
+			uint32_t &photonsMask = observer.m_echoPhotonsMasks[echoPhoton.m_bodyCellIndex];
+			Photon &photon = observer.m_echoPhotons[echoPhoton.m_bodyCellIndex][echoPhoton.m_cellPhotonIndex];
+			if (!CHECK_BIT(photonsMask, echoPhoton.m_cellPhotonIndex) || IsPhotonStronger(echoPhoton.m_photon, photon))
+			{
+				photon = echoPhoton.m_photon;
+				photonsMask |= 1 << echoPhoton.m_cellPhotonIndex;
+			}
+		}
+		echoPhotons.clear();
+	}
+}
+
+uint32_t GrabEchoPhotons(uint8_t observerIndex, uint32_t bodyCellIndex, EtherCellPhotonArray &outPhotons, uint32_t etherPhotonsMask)
+{
+	ObserverCell &observer = s_observers[observerIndex];
+	uint32_t photonsMask = observer.m_echoPhotonsMasks[bodyCellIndex];
+	observer.m_echoPhotonsMasks[bodyCellIndex] = 0;
+	for (uint32_t mask = photonsMask; mask; mask &= mask - 1)
+	{
+		uint32_t ii = CountTrailingZeros(mask);
+		const Photon &photon = observer.m_echoPhotons[bodyCellIndex][ii];
+		if (!CHECK_BIT(etherPhotonsMask, ii) || IsPhotonStronger(photon, outPhotons[ii]))
+		{
+			outPhotons[ii] = photon;
+		}
+	}
+	return etherPhotonsMask | photonsMask;
+}
+
+const char* RecvClientMsg(const Observer *observer)
+{
+	assert(s_observers.size() > observer->m_index);
+	SOCKET socket = s_observers[observer->m_index].m_socket;
+	struct sockaddr_in &from = s_observers[observer->m_index].m_clientAddr;
+
+	static char buffer[CommonParams::DEFAULT_BUFLEN];
+	struct sockaddr_in fromCur;
+	int fromlen = sizeof(sockaddr_in);
+	int result = recvfrom(socket, buffer, sizeof(buffer), 0, (sockaddr*)&fromCur, &fromlen);
+	if (result > 0)
+	{
+		if (from.sin_addr.s_addr != fromCur.sin_addr.s_addr || from.sin_port != fromCur.sin_port)
+		{
+			if (const MsgCheckVersion *msg = QueryMessage<MsgCheckVersion>(buffer))
+			{
+				if (msg->m_observerId == reinterpret_cast<uint64_t>(observer))
+				{
+					from = fromCur;
+					return &buffer[0];
+				}
+			}
+			MsgSocketBusyByAnotherObserver msg;
+			msg.m_serverVersion = CommonParams::PROTOCOL_VERSION;
+			sendto(socket, msg.GetBuffer(), sizeof(msg), 0, (sockaddr*)&fromCur, fromlen);
+			return nullptr;
+		}
+		return &buffer[0];
+	}
+
+	return nullptr;
+}
+
+void SendClientMsg(const Observer *observer, const MsgBase &msg, int32_t msgSize)
 {
-	return m_isSimulationRunning;
+	assert(s_observers.size() > observer->m_index);
+	SOCKET socket = s_observers[observer->m_index].m_socket;
+	struct sockaddr_in &from = s_observers[observer->m_index].m_clientAddr;
+	int fromlen = sizeof(sockaddr_in);
+
+	sendto(socket, msg.GetBuffer(), msgSize, 0, (sockaddr*)&from, fromlen);
 }
 
-uint32_t GetCellPhotonIndex(const VectorInt32Math &unitVector)
+void HandleOtherObserversPhotons(const Observer *observer)
 {
-	int32_t index = (unitVector.m_posX + 1) * 9 + (unitVector.m_posY + 1) * 3 + (unitVector.m_posZ + 1);
-	if (index > 13)
+	assert(s_observers.size() > observer->m_index);
+	VectorInt32Math pos = s_observers[observer->m_index].m_position;
+	int32_t cellIndex = GetCellIndex(pos);
+	int isTimeOdd = s_time % 2;
+	std::atomic<uint32_t> &photonsMask = GetEtherPhotonsMask(cellIndex, isTimeOdd);
+	uint32_t mask = photonsMask.load(std::memory_order_relaxed);
+	if (!mask)
 	{
-		--index;
+		return;
 	}
-	return index;
+	uint32_t handledMask = 0;
+	while (mask)
+	{
+		uint32_t ii = CountTrailingZeros(mask);
+		mask &= mask - 1;
+		Photon &photon = GetEtherPhoton(cellIndex, isTimeOdd, ii);
+		if (photon.m_param2 != observer->m_index)
+		{
+			PhotonStepForward(pos, cellIndex, photon);
+			handledMask |= 1 << ii;
+		}
+	}
+	photonsMask.fetch_and(~handledMask, std::memory_order_relaxed);
 }
 
-VectorInt32Math GetUnitVectorFromPhotonIndex(uint32_t index) // index [0;25]
+VectorInt32Math GetCellPos(int32_t cellIndex)
 {
-	if (index > 12)
+	int32_t brickIndex = GetBrickIndex(cellIndex);
+	int32_t indexInBrick = GetIndexInBrick(cellIndex);
+	int32_t brickX = brickIndex / s_bricksStrideX;
+	brickIndex -= brickX * s_bricksStrideX;
+	int32_t brickY = brickIndex / s_bricksStrideY;
+	int32_t brickZ = brickIndex - brickY * s_bricksStrideY;
+	return VectorInt32Math(brickX << ETHER_BRICK_SIZE_SHIFT, brickY << ETHER_BRICK_SIZE_SHIFT, brickZ << ETHER_BRICK_SIZE_SHIFT) +
+		s_brickCellPositions[indexInBrick];
+}
+
+// cell should be added once when it gets first photon for quantum of time
+void AddActiveCell(int32_t posX, int32_t cellIndex, int32_t isTimeOdd)
+{
+	s_activeCells[s_threadByPosX[posX]][t_threadIndex].m_cellIndices[isTimeOdd].push_back(cellIndex);
+}
+
+// photons left in observer cell are not in active cells lists. Observers thread moves Daphnia while universe threads walk
+// the lists, so cell is queued till tick barrier
+void ActivateVacatedCell(int32_t cellIndex)
+{
+	if (m_simulationEngine == SimulationEngine::ActivePhotons)
 	{
-		++index;
+		s_vacatedCells.push_back(cellIndex);
+	}
+}
+
+void ActivateVacatedCells()
+{
+	int32_t isTimeOdd = (s_time + s_epochTicks) % 2; // lists of other parity are walked already
+	for (int32_t cellIndex : s_vacatedCells)
+	{
+		if (GetEtherPhotonsMask(cellIndex, isTimeOdd).load(std::memory_order_relaxed))
+		{
+			AddActiveCell(GetCellPos(cellIndex).m_posX, cellIndex, isTimeOdd); // if cell is in list already, second visit finds no photons
+		}
+	}
+	s_vacatedCells.clear();
+}
+
+uint32_t GrabEtherPhotons(int32_t cellIndex, EtherCellPhotonArray &outPhotons)
+{
+	int isTimeOdd = s_time % 2;
+	uint32_t photonsMask = GetEtherPhotonsMask(cellIndex, isTimeOdd).exchange(0, std::memory_order_relaxed);
+	if (!photonsMask)
+	{
+		return 0;
+	}
+	EtherBrick *brick = GetEtherBrick(cellIndex);
+	int32_t indexInBrick = GetIndexInBrick(cellIndex);
+	for (uint32_t mask = photonsMask; mask; mask &= mask - 1)
+	{
+		uint32_t ii = CountTrailingZeros(mask);
+		outPhotons[ii] = GetEtherPhoton(brick, indexInBrick, isTimeOdd, ii);
+	}
+	return photonsMask;
+}
+
+uint32_t GrabReceivedPhotons(const class Observer *observer, EtherCellPhotonArray &outPhotons)
+{
+	assert(s_observers.size() > observer->m_index);
+	VectorInt32Math pos = s_observers[observer->m_index].m_position;
+	uint32_t photonsMask = GrabEtherPhotons(GetCellIndex(pos), outPhotons);
+	if (s_bRayCastEcholocation)
+	{
+		photonsMask = GrabEchoPhotons(observer->m_index, 0, outPhotons, photonsMask);
+	}
+	return photonsMask;
+}
+
+uint32_t GrabReceivedPhotonsForBigDaphnia(const Observer * observer, uint32_t index, EtherCellPhotonArray &outPhotons)
+{
+	assert(s_observers.size() > observer->m_index);
+	assert(index < 3 * 3 * 3 - 1); // 3x3x3 exclude central cell
+	VectorInt32Math pos = s_observers[observer->m_index].m_position;
+	uint32_t photonsMask = GrabEtherPhotons(GetCellIndex(pos + GetUnitVectorFromPhotonIndex(index)), outPhotons);
+	if (s_bRayCastEcholocation)
+	{
+		photonsMask = GrabEchoPhotons(observer->m_index, index, outPhotons, photonsMask);
+	}
+	return photonsMask;
+}
+
+PPh::VectorInt32Math GetObserverPosition(const class Observer *observer)
+{
+	assert(s_observers.size() > observer->m_index);
+	VectorInt32Math pos = s_observers[observer->m_index].m_position;
+	return pos;
+}
+
+/*void ClearReceivedPhotons(const Observer *observer)
+{
+	assert(s_observers.size() > observer->m_index);
+	VectorInt32Math pos = s_observers[observer->m_index].m_position;
+	int isTimeOdd = (s_time) % 2;
+	int32_t cellIndex = GetCellIndex(pos);
+	for (int32_t ii = 0; ii < CELL_PHOTONS_COUNT; ++ii)
+	{
+		Photon &photon = GetEtherPhoton(cellIndex, isTimeOdd, ii);
+		if (photon.m_param2 == observer->m_index)
+		{
+			photon.m_color.m_colorA = 0;
+		}
+	}
+}*/
+
+void AdjustSizeByBounds(VectorInt32Math &size)
+{
+	const VectorInt32Math &universeSize = GetUniverseSize();
+	size.m_posX = std::max(0, size.m_posX);
+	size.m_posY = std::max(0, size.m_posY);
+	size.m_posZ = std::max(0, size.m_posZ);
+
+	size.m_posX = std::min(universeSize.m_posX, size.m_posX);
+	size.m_posY = std::min(universeSize.m_posY, size.m_posY);
+	size.m_posZ = std::min(universeSize.m_posZ, size.m_posZ);
+}
+
+PPh::VectorInt32Math GetRandomEmptyCell()
+{
+	for (int ii=0; ii<10000; ++ii)
+	{
+		int32_t posX = Rand32(m_universeSize.m_posX);
+		int32_t posY = Rand32(m_universeSize.m_posY);
+		int32_t posZ = Rand32(m_universeSize.m_posZ);
+		VectorInt32Math pos(posX, posY, posZ);
+		if (CanDaphniaMoveToNextCell(pos))
+		{
+			return VectorInt32Math(posX, posY, posZ);
+		}
+	}
+	assert(false);
+	return VectorInt32Math::ZeroVector;
+}
+
+bool InitEtherCell(const VectorInt32Math &pos, EtherType::EEtherType type, const EtherColor &color)
+{
+	uint8_t colorIndex = 0;
+	if (IsPosInBounds(pos) && GetPaletteIndex(color, colorIndex))
+	{
+		int32_t cellIndex = GetCellIndex(pos);
+		SetEtherType(cellIndex, type);
+		s_etherColors[cellIndex] = colorIndex;
+		InvalidateEmptyDistances(pos);
+		for (int32_t isTimeOdd = 0; isTimeOdd < 2; ++isTimeOdd)
+		{
+			GetEtherPhotonsMask(cellIndex, isTimeOdd) = 0;
+		}
+		return true;
+	}
+	return false;
+}
+
+bool GetPaletteIndex(const EtherColor &color, uint8_t &outIndex)
+{
+	uint32_t paletteSize = s_etherPaletteSize;
+	for (uint32_t ii = 0; ii < paletteSize; ++ii)
+	{
+		if (s_etherPalette[ii] == color)
+		{
+			outIndex = (uint8_t)ii;
+			return true;
+		}
+	}
+	if (paletteSize < s_etherPalette.size())
+	{
+		s_etherPalette[paletteSize] = color;
+		s_etherPaletteSize = paletteSize + 1; // publish after the color is written
+		outIndex = (uint8_t)paletteSize;
+		return true;
+	}
+	printf("Ether palette is full\n");
+	return false;
+}
+
+// pages are committed by OS on first touch, see FirstTouchEtherPlanes
+template<class T>
+T* AllocateEtherPlane(size_t count)
+{
+	return static_cast<T*>(VirtualAlloc(nullptr, count * sizeof(T), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+}
+
+void FreeEtherPlanes()
+{
+	for (const std::pair<void*, size_t> &chunk : s_etherChunks)
+	{
+		VirtualFree(chunk.first, 0, MEM_RELEASE);
+	}
+	s_etherChunks.clear();
+	for (AllocatedBricks &allocatedBricks : s_allocatedBricks)
+	{
+		allocatedBricks.m_bricks.clear();
+	}
+	s_residentBricks.clear();
+	s_freeBricks.clear();
+	for (void *plane : { (void*)s_etherTypes, (void*)s_etherColors, (void*)s_etherBricks, (void*)s_emptyDistances })
+	{
+		if (plane)
+		{
+			VirtualFree(plane, 0, MEM_RELEASE);
+		}
+	}
+	s_etherTypes = nullptr;
+	s_etherColors = nullptr;
+	s_etherBricks = nullptr;
+	s_emptyDistances = nullptr;
+}
+
+// geometry of every X slab is written first by thread bound to NUMA node of slab owner
+void FirstTouchEtherPlanes(uint8_t spaceColorIndex)
+{
+	static_assert(EtherType::Space == 0, "type plane is zero filled");
+	std::vector<std::thread> threads;
+	for (int ii = 0; ii < m_threadsCount; ++ii)
+	{
+		threads.push_back(std::thread([ii, spaceColorIndex]()
+		{
+			if (s_bNumaPlacement)
+			{
+				BindThreadToNumaNode(s_threadNumaNodes[ii]);
+			}
+			for (int32_t brickX = 0; brickX < s_bricksSize.m_posX; ++brickX)
+			{
+				if (s_threadByPosX[brickX << ETHER_BRICK_SIZE_SHIFT] != ii)
+				{
+					continue;
+				}
+				size_t beginCell = (size_t)brickX * s_bricksStrideX * ETHER_BRICK_CELLS;
+				size_t cellsCount = (size_t)s_bricksStrideX * ETHER_BRICK_CELLS;
+				std::uninitialized_fill_n(s_etherTypes + beginCell / 4, cellsCount / 4, (uint8_t)0);
+				std::fill_n(s_etherColors + beginCell, cellsCount, spaceColorIndex);
+			}
+		}));
+	}
+	for (std::thread &thread : threads)
+	{
+		thread.join();
+	}
+}
+
+bool EnableLargePages()
+{
+	HANDLE token;
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+	{
+		printf("Large pages: failed to open process token\n");
+		return false;
+	}
+	TOKEN_PRIVILEGES privileges;
+	privileges.PrivilegeCount = 1;
+	privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+	bool bResult = LookupPrivilegeValue(nullptr, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid) &&
+		AdjustTokenPrivileges(token, FALSE, &privileges, 0, nullptr, nullptr) && GetLastError() == ERROR_SUCCESS;
+	CloseHandle(token);
+	if (!bResult)
+	{
+		printf("Large pages: SeLockMemoryPrivilege is not granted, regular pages are used\n");
+	}
+	return bResult;
+}
+
+void* AllocateEtherMemory(size_t size, uint32_t numaNode, bool bLargePages)
+{
+	DWORD allocationType = MEM_RESERVE | MEM_COMMIT | (bLargePages ? MEM_LARGE_PAGES : 0);
+	if (s_bNumaPlacement)
+	{
+		return VirtualAllocExNuma(GetCurrentProcess(), nullptr, size, allocationType, PAGE_READWRITE, numaNode);
+	}
+	return VirtualAlloc(nullptr, size, allocationType, PAGE_READWRITE);
+}
+
+void BindThreadToNumaNode(uint32_t numaNode)
+{
+	GROUP_AFFINITY affinity = {};
+	if (!GetNumaNodeProcessorMaskEx((USHORT)numaNode, &affinity) || !SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr))
+	{
+		printf("Failed to bind thread to NUMA node %u\n", numaNode);
+	}
+}
+
+bool PlanThreadCpus()
+{
+	DWORD length = 0;
+	GetLogicalProcessorInformationEx(RelationAll, nullptr, &length);
+	std::vector<uint8_t> buffer(length);
+	if (!length || !GetLogicalProcessorInformationEx(RelationAll, reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(buffer.data()), &length))
+	{
+		printf("Failed to get processors topology, threads are not pinned\n");
+		return false;
+	}
+	struct CpuCore
+	{
+		PROCESSOR_NUMBER m_cpu; // first logical processor of physical core
+		USHORT m_numaNode;
+		uint32_t m_l3Cache; // index in l3Caches, cores without known L3 go last
+	};
+	std::vector<CpuCore> cores;
+	std::vector<GROUP_AFFINITY> l3Caches;
+	for (DWORD offset = 0; offset < length; )
+	{
+		const auto *info = reinterpret_cast<const SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(buffer.data() + offset);
+		if (info->Relationship == RelationProcessorCore)
+		{
+			unsigned long number;
+			uint64_t mask = info->Processor.GroupMask[0].Mask; // KAFFINITY is 32 bit in Win32 build, _BitScanForward64 is x64 only
+			if (!_BitScanForward(&number, (unsigned long)mask))
+			{
+				_BitScanForward(&number, (unsigned long)(mask >> 32));
+				number += 32;
+			}
+			CpuCore core = {};
+			core.m_cpu.Group = info->Processor.GroupMask[0].Group;
+			core.m_cpu.Number = (BYTE)number;
+			cores.push_back(core);
+		}
+		else if (info->Relationship == RelationCache && info->Cache.Level == 3)
+		{
+			l3Caches.push_back(info->Cache.GroupMask);
+		}
+		offset += info->Size;
+	}
+	if (cores.empty())
+	{
+		printf("No processor cores found, threads are not pinned\n");
+		return false;
+	}
+	for (CpuCore &core : cores)
+	{
+		if (!GetNumaProcessorNodeEx(&core.m_cpu, &core.m_numaNode))
+		{
+			core.m_numaNode = 0;
+		}
+		core.m_l3Cache = 0;
+		while (core.m_l3Cache < l3Caches.size() && (l3Caches[core.m_l3Cache].Group != core.m_cpu.Group ||
+			!((l3Caches[core.m_l3Cache].Mask >> core.m_cpu.Number) & 1)))
+		{
+			++core.m_l3Cache;
+		}
+	}
+	std::sort(cores.begin(), cores.end(), [](const CpuCore &left, const CpuCore &right)
+	{
+		return std::tie(left.m_numaNode, left.m_l3Cache, left.m_cpu.Group, left.m_cpu.Number) <
+			std::tie(right.m_numaNode, right.m_l3Cache, right.m_cpu.Group, right.m_cpu.Number);
+	});
+
+	// observers thread takes the last core, universe threads leave core of network interrupts to admin thread if they can
+	s_adminTcpCpu = {};
+	auto isAdminTcpCore = [](const CpuCore &core) { return core.m_cpu.Group == s_adminTcpCpu.Group && core.m_cpu.Number == s_adminTcpCpu.Number; };
+	size_t observersCore = cores.size() - 1;
+	while (observersCore > 0 && isAdminTcpCore(cores[observersCore]))
+	{
+		--observersCore;
+	}
+	std::vector<CpuCore> universeCores;
+	for (size_t ii = 0; ii < cores.size(); ++ii)
+	{
+		if (ii != observersCore && (cores.size() - 1 <= m_threadsCount || !isAdminTcpCore(cores[ii])))
+		{
+			universeCores.push_back(cores[ii]);
+		}
+	}
+	if (universeCores.empty())
+	{
+		universeCores.push_back(cores[observersCore]); // single core
+	}
+
+	// neighbour X slabs take neighbour cores, so they share L3 cache and NUMA node
+	s_threadCpus.resize(m_threadsCount + 1);
+	std::vector<bool> isCoreTaken(universeCores.size(), false);
+	for (int32_t ii = 0; ii < m_threadsCount; ++ii)
+	{
+		size_t coreIndex = 0;
+		while (coreIndex < universeCores.size() && (isCoreTaken[coreIndex] ||
+			(s_bNumaPlacement && universeCores[coreIndex].m_numaNode != s_threadNumaNodes[ii])))
+		{
+			++coreIndex;
+		}
+		if (coreIndex < universeCores.size())
+		{
+			isCoreTaken[coreIndex] = true;
+		}
+		else
+		{
+			coreIndex = ii % universeCores.size(); // more threads than cores
+		}
+		s_threadCpus[ii] = universeCores[coreIndex].m_cpu;
+	}
+	s_threadCpus[m_threadsCount] = cores[observersCore].m_cpu;
+	return true;
+}
+
+void PinThreadToCpu(HANDLE thread, const PROCESSOR_NUMBER &cpu)
+{
+	GROUP_AFFINITY affinity = {};
+	affinity.Group = cpu.Group;
+	affinity.Mask = (KAFFINITY)1 << cpu.Number;
+	if (!SetThreadGroupAffinity(thread, &affinity, nullptr))
+	{
+		printf("Failed to pin thread to cpu %u:%u\n", cpu.Group, cpu.Number);
 	}
-	VectorInt32Math unitVector;
-	unitVector.m_posX = index / 9 - 1;
-	unitVector.m_posY = (index - (unitVector.m_posX + 1) * 9)  / 3 - 1;
-	unitVector.m_posZ = (index - (unitVector.m_posX + 1) * 9 - (unitVector.m_posY + 1) * 3) - 1;
-	return unitVector;
 }
 
-bool IsPosInBounds(const VectorInt32Math &pos)
+EtherBrick* AllocateEtherBrick(int32_t cellIndex)
 {
-	const VectorInt32Math &size = GetUniverseSize();
-	if (pos.m_posX < 0 || pos.m_posY < 0 || pos.m_posZ < 0)
+	int32_t brickIndex = GetBrickIndex(cellIndex);
+	std::atomic<EtherBrick*> &brickSlot = s_etherBricks[brickIndex];
+	uint32_t numaNode = 0;
+	if (s_bNumaPlacement)
 	{
-		return false;
+		int32_t brickX = brickIndex / s_bricksStrideX;
+		numaNode = s_threadNumaNodes[s_threadByPosX[brickX << ETHER_BRICK_SIZE_SHIFT]];
 	}
-	if (pos.m_posX >= size.m_posX || pos.m_posY >= size.m_posY || pos.m_posZ >= size.m_posZ)
+	EtherBrick *brick = nullptr;
 	{
-		return false;
+		std::lock_guard<std::mutex> lock(s_etherBricksMutex);
+		std::vector<EtherBrick*> &freeBricks = s_freeBricks[numaNode];
+		if (freeBricks.empty())
+		{
+			void *chunk = AllocateEtherMemory(s_etherChunkSize, numaNode, s_bLargePages);
+			if (!chunk)
+			{
+				printf("Not enough memory for ether bricks chunk\n");
+				return nullptr;
+			}
+			s_etherChunks.push_back({ chunk, s_etherChunkSize });
+			for (size_t offset = 0; offset + s_etherBrickSize <= s_etherChunkSize; offset += s_etherBrickSize)
+			{
+				EtherBrick *newBrick = reinterpret_cast<EtherBrick*>(static_cast<uint8_t*>(chunk) + offset);
+				for (auto &photonMasks : newBrick->m_photonMasks)
+				{
+					std::uninitialized_value_construct(photonMasks.begin(), photonMasks.end());
+				}
+				new (&newBrick->m_lastEmitTime) std::atomic<uint64_t>(0);
+				newBrick->m_numaNode = numaNode;
+				freeBricks.push_back(newBrick);
+			}
+		}
+		brick = freeBricks.back();
+		freeBricks.pop_back();
 	}
-	return true;
+	brick->m_brickIndex = brickIndex;
+	EtherBrick *residentBrick = nullptr;
+	if (!brickSlot.compare_exchange_strong(residentBrick, brick, std::memory_order_acq_rel))
+	{ // another thread was faster
+		std::lock_guard<std::mutex> lock(s_etherBricksMutex);
+		s_freeBricks[brick->m_numaNode].push_back(brick);
+		return residentBrick;
+	}
+	s_allocatedBricks[t_threadIndex].m_bricks.push_back(brick);
+	return brick;
 }
 
-bool GetNextCrumb(VectorInt32Math & outCrumbPos, EtherColor & outCrumbColor)
+// called by simulation thread between quantums of time, when other threads wait
+void ReleaseEmptyEtherBricks()
 {
-	static int32_t s_posX = 0;
-	static int32_t s_posY = 0;
-	static int32_t s_posZ = 0;
-	bool bResult = false;
-	for (; s_posX < s_universe.size(); ++s_posX, s_posY=0)
+	for (AllocatedBricks &allocatedBricks : s_allocatedBricks)
+	{
+		s_residentBricks.insert(s_residentBricks.end(), allocatedBricks.m_bricks.begin(), allocatedBricks.m_bricks.end());
+		allocatedBricks.m_bricks.clear();
+	}
+	if ((s_time + s_epochTicks - 1) % ETHER_BRICKS_RELEASE_PERIOD >= (uint64_t)s_epochTicks)
+	{
+		return; // epoch doesn't hold multiple of period
+	}
+	uint64_t time = s_time + s_epochTicks - 1; // last stepped quantum of time
+	auto isBrickEmpty = [time](const EtherBrick *brick)
 	{
-		for (; s_posY < s_universe[s_posX].size(); ++s_posY, s_posZ=0)
+		if (brick->m_lastEmitTime.load(std::memory_order_relaxed) > time)
+		{
+			return false; // photons for next quantum of time
+		}
+		for (const auto &photonMasks : brick->m_photonMasks)
 		{
-			for (; s_posZ < s_universe[s_posX][s_posY].size(); ++s_posZ)
+			for (const std::atomic<uint32_t> &photonsMask : photonMasks)
 			{
-				if (bResult)
+				if (photonsMask.load(std::memory_order_relaxed))
 				{
-					break;
-				}
-				auto &cell = s_universe[s_posX][s_posY][s_posZ];
-				if (cell.m_type == EtherType::Crumb)
-				{
-					if (s_posX && s_posY && s_posZ)
-					{
-						auto &cellX = s_universe[s_posX-1][s_posY][s_posZ];
-						auto &cellY = s_universe[s_posX][s_posY-1][s_posZ];
-						auto &cellZ = s_universe[s_posX][s_posY][s_posZ-1];
-						if (cellX.m_type == EtherType::Crumb || cellY.m_type == EtherType::Crumb || cellZ.m_type == EtherType::Crumb)
-						{
-							continue;
-						}
-					}
-					outCrumbPos = VectorInt32Math(s_posX, s_posY, s_posZ);
-					outCrumbColor = cell.m_color;
-					bResult = true;
+					return false; // photons in observer cells wait to be grabbed
 				}
 			}
-			if (bResult)
-			{
-				break;
-			}
-		}
-		if (bResult)
-		{
-			break;
 		}
+		return true;
+	};
+	auto itEmpty = std::partition(s_residentBricks.begin(), s_residentBricks.end(), [&isBrickEmpty](const EtherBrick *brick) { return !isBrickEmpty(brick); });
+	for (auto it = itEmpty; it != s_residentBricks.end(); ++it)
+	{
+		s_etherBricks[(*it)->m_brickIndex].store(nullptr, std::memory_order_relaxed);
 	}
-	if (!bResult)
+	std::lock_guard<std::mutex> lock(s_etherBricksMutex);
+	for (auto it = itEmpty; it != s_residentBricks.end(); ++it)
 	{
-		s_posX = 0;
-		s_posY = 0;
-		s_posZ = 0;
+		s_freeBricks[(*it)->m_numaNode].push_back(*it);
 	}
-	return bResult;
+	s_residentBricks.erase(itEmpty, s_residentBricks.end());
 }
 
-void SetAdminObserverId(uint64_t observerId)
+bool EmitPhoton(const VectorInt32Math &pos, const Photon &photon)
 {
-	m_adminObserverId = observerId;
+	Photon steppedPhoton = photon;
+	VectorInt8Math shift = PhotonKernel::StepPhoton(m_photonStepMode, steppedPhoton);
+	VectorInt32Math unitVector(shift.m_posX, shift.m_posY, shift.m_posZ);
+	int32_t cellPhotonIndex = GetCellPhotonIndex(unitVector);
+	uint64_t emitTime = s_time + s_epochTicks; // will be handle on next quantum of time, after tick barrier
+	if (m_simulationEngine == SimulationEngine::ActivePhotons)
+	{
+		return emitTime % 2 ? EmitPhoton<SimulationEngine::ActivePhotons, 1>(pos, steppedPhoton, unitVector, cellPhotonIndex, emitTime) :
+			EmitPhoton<SimulationEngine::ActivePhotons, 0>(pos, steppedPhoton, unitVector, cellPhotonIndex, emitTime);
+	}
+	return emitTime % 2 ? EmitPhoton<SimulationEngine::BoxSweep, 1>(pos, steppedPhoton, unitVector, cellPhotonIndex, emitTime) :
+		EmitPhoton<SimulationEngine::BoxSweep, 0>(pos, steppedPhoton, unitVector, cellPhotonIndex, emitTime);
 }
 
-bool EmitEcholocationPhoton(const Observer *observer, const OrientationVectorMath &orientation, PhotonParam param)
+template<SimulationEngine ENGINE, int32_t IS_NEXT_TIME_ODD>
+bool EmitPhoton(const VectorInt32Math &pos, const Photon &photon, const VectorInt32Math &unitVector, int32_t cellPhotonIndex, uint64_t emitTime)
 {
-	assert(s_observers.size() > observer->m_index);
-	VectorInt32Math pos = s_observers[observer->m_index].m_position;
-	Photon photon(orientation);
-	photon.m_param = param;
-	photon.m_param2 = observer->m_index;
-	photon.m_color.m_colorA = 255;
-	if (IS_DAPHNIA_BIG)
+	VectorInt32Math nextPos = pos + unitVector;
+	assert(unitVector != VectorInt32Math::ZeroVector); // maximized orientation always has a component of PPH_INT_MAX
+	if (IsPosInBounds(nextPos))
 	{
-		VectorInt32Math unitVector = CalculatePositionShift(pos, photon.m_orientation);
-		pos = pos + unitVector;
+		int32_t nextCellIndex = GetCellIndex(nextPos);
+		if (nextPos.m_posX < t_directEmitMinX || t_directEmitMaxX <= nextPos.m_posX)
+		{
+			s_haloPhotons[t_threadIndex].m_photons.push_back({ nextPos.m_posX, nextCellIndex, cellPhotonIndex, photon });
+			return true;
+		}
+		return WriteEtherPhoton<ENGINE, IS_NEXT_TIME_ODD>(nextPos.m_posX, nextCellIndex, cellPhotonIndex, photon, emitTime);
 	}
-	return EmitPhoton(pos, photon);
+	
+	return true;
 }
 
-const char* RecvClientMsg(const Observer *observer)
+// only one thread writes to cell during quantum of time, so photons mask doesn't need read-modify-write.
+// IS_MERGE: called at tick barrier, nobody else touches ether
+template<SimulationEngine ENGINE, int32_t IS_NEXT_TIME_ODD, bool IS_MERGE>
+bool WriteEtherPhoton(int32_t posX, int32_t cellIndex, int32_t cellPhotonIndex, const Photon &photon, uint64_t emitTime)
 {
-	assert(s_observers.size() > observer->m_index);
-	SOCKET socket = s_observers[observer->m_index].m_socket;
-	struct sockaddr_in &from = s_observers[observer->m_index].m_clientAddr;
-
-	static char buffer[CommonParams::DEFAULT_BUFLEN];
-	struct sockaddr_in fromCur;
-	int fromlen = sizeof(sockaddr_in);
-	int result = recvfrom(socket, buffer, sizeof(buffer), 0, (sockaddr*)&fromCur, &fromlen);
-	if (result > 0)
+	EtherBrick *brick = GetEtherBrick(cellIndex);
+	if (!brick)
 	{
-		if (from.sin_addr.s_addr != fromCur.sin_addr.s_addr || from.sin_port != fromCur.sin_port)
+		brick = AllocateEtherBrick(cellIndex);
+		if (!brick)
 		{
-			if (const MsgCheckVersion *msg = QueryMessage<MsgCheckVersion>(buffer))
+			return false;
+		}
+	}
+	int32_t indexInBrick = GetIndexInBrick(cellIndex);
+	std::atomic<uint32_t> &photonsMask = brick->m_photonMasks[IS_NEXT_TIME_ODD][indexInBrick];
+	Photon &slotPhoton = GetEtherPhoton(brick, indexInBrick, IS_NEXT_TIME_ODD, cellPhotonIndex);
+	uint32_t photonBit = 1 << cellPhotonIndex;
+	if (!IS_MERGE && s_epochTicks > 1 && GetEtherType(cellIndex) == EtherType::Observer)
+	{ // observers thread reads its cells during epoch
+		s_haloPhotons[t_threadIndex].m_photons.push_back({ posX, cellIndex, cellPhotonIndex, photon });
+		return true;
+	}
+	if (s_photonBuffersCount == 1)
+	{ // slot could hold photon of current quantum of time, masks of both parities never have the same bit
+		std::atomic<uint32_t> &currentMask = brick->m_photonMasks[1 - IS_NEXT_TIME_ODD][indexInBrick];
+		uint32_t currentPhotons = currentMask.load(std::memory_order_relaxed);
+		if (!IS_MERGE && ((currentPhotons & photonBit) || GetEtherType(cellIndex) == EtherType::Observer)) // observers thread reads its cells
+		{
+			s_haloPhotons[t_threadIndex].m_photons.push_back({ posX, cellIndex, cellPhotonIndex, photon });
+			return true;
+		}
+		if (currentPhotons & photonBit)
+		{ // photon wasn't stepped: observer didn't grab it or cell is out of simulation bounds
+			if (!IsPhotonStronger(photon, slotPhoton))
 			{
-				if (msg->m_observerId == reinterpret_cast<uint64_t>(observer))
-				{
-					from = fromCur;
-					return &buffer[0];
-				}
+				return false;
 			}
-			MsgSocketBusyByAnotherObserver msg;
-			msg.m_serverVersion = CommonParams::PROTOCOL_VERSION;
-			sendto(socket, msg.GetBuffer(), sizeof(msg), 0, (sockaddr*)&fromCur, fromlen);
-			return nullptr;
+			currentMask.store(currentPhotons & ~photonBit, std::memory_order_relaxed);
 		}
-		return &buffer[0];
 	}
-
-	return nullptr;
-}
-
-void SendClientMsg(const Observer *observer, const MsgBase &msg, int32_t msgSize)
-{
-	assert(s_observers.size() > observer->m_index);
-	SOCKET socket = s_observers[observer->m_index].m_socket;
-	struct sockaddr_in &from = s_observers[observer->m_index].m_clientAddr;
-	int fromlen = sizeof(sockaddr_in);
-
-	sendto(socket, msg.GetBuffer(), msgSize, 0, (sockaddr*)&from, fromlen);
-}
-
-void HandleOtherObserversPhotons(const Observer *observer)
-{
-	assert(s_observers.size() > observer->m_index);
-	VectorInt32Math pos = s_observers[observer->m_index].m_position;
-	EtherCell &cell = s_universe[pos.m_posX][pos.m_posY][pos.m_posZ];
-	int isTimeOdd = s_time % 2;
-	EtherCellPhotonArray &photonArray = cell.m_photons[isTimeOdd];
-	for (Photon &photon : photonArray)
+	uint32_t prevMask = photonsMask.load(std::memory_order_relaxed);
+	if (prevMask & photonBit)
+	{
+		if (!IsPhotonStronger(photon, slotPhoton))
+		{
+			return false;
+		}
+	}
+	if (brick->m_lastEmitTime.load(std::memory_order_relaxed) != emitTime)
+	{
+		brick->m_lastEmitTime.store(emitTime, std::memory_order_relaxed);
+	}
+	slotPhoton = photon;
+	photonsMask.store(prevMask | photonBit, std::memory_order_relaxed);
+	if constexpr (ENGINE == SimulationEngine::ActivePhotons)
 	{
-		if (photon.m_color.m_colorA >0 && photon.m_param2 != observer->m_index)
+		if (!prevMask)
 		{
-			PhotonStepForward(pos, photon, cell);
+			AddActiveCell(posX, cellIndex, IS_NEXT_TIME_ODD);
 		}
 	}
+	return true;
 }
 
-EtherCellPhotonArray& GetReceivedPhotons(const class Observer *observer)
+template<SimulationEngine ENGINE, int32_t IS_NEXT_TIME_ODD>
+void MergeHaloPhotons(uint64_t emitTime)
 {
-	assert(s_observers.size() > observer->m_index);
-	VectorInt32Math pos = s_observers[observer->m_index].m_position;
-	EtherCell &cell = s_universe[pos.m_posX][pos.m_posY][pos.m_posZ];
-	int isTimeOdd = s_time % 2;
-	EtherCellPhotonArray &photonArray = cell.m_photons[isTimeOdd];
-	return photonArray;
+	s_mergedHaloPhotons.clear();
+	for (HaloPhotons &haloPhotons : s_haloPhotons)
+	{
+		s_mergedHaloPhotons.insert(s_mergedHaloPhotons.end(), haloPhotons.m_photons.begin(), haloPhotons.m_photons.end());
+		haloPhotons.m_photons.clear();
+	}
+	for (PhotonWheel &photonWheel : s_photonWheels)
+	{
+		std::vector<HaloPhoton> &landingPhotons = photonWheel.m_photons[emitTime % PHOTON_WHEEL_SIZE];
+		s_mergedHaloPhotons.insert(s_mergedHaloPhotons.end(), landingPhotons.begin(), landingPhotons.end());
+		landingPhotons.clear();
+	}
+	// photons of one slot are resolved by IsPhotonStronger, order of cells is kept for bricks allocation and active cells
+	std::sort(s_mergedHaloPhotons.begin(), s_mergedHaloPhotons.end(), [](const HaloPhoton &left, const HaloPhoton &right)
+	{
+		return left.m_cellIndex != right.m_cellIndex ? left.m_cellIndex < right.m_cellIndex : left.m_cellPhotonIndex < right.m_cellPhotonIndex;
+	});
+	for (const HaloPhoton &haloPhoton : s_mergedHaloPhotons)
+	{
+		WriteEtherPhoton<ENGINE, IS_NEXT_TIME_ODD, true>(haloPhoton.m_posX, haloPhoton.m_cellIndex, haloPhoton.m_cellPhotonIndex, haloPhoton.m_photon, emitTime);
+	}
 }
 
-EtherCellPhotonArray& GetReceivedPhotonsForBigDaphnia(const Observer * observer, uint32_t index)
+// should be called at tick barrier, when all threads have emitted photons of quantum of time
+void MergeHaloPhotons()
 {
-	assert(s_observers.size() > observer->m_index);
-	assert(index < 3 * 3 * 3 - 1); // 3x3x3 exclude central cell
-	VectorInt32Math pos = s_observers[observer->m_index].m_position;
-	pos = pos + GetUnitVectorFromPhotonIndex(index);
-	EtherCell &cell = s_universe[pos.m_posX][pos.m_posY][pos.m_posZ];
-	int isTimeOdd = s_time % 2;
-	EtherCellPhotonArray &photonArray = cell.m_photons[isTimeOdd];
-	return photonArray;
+	uint64_t emitTime = s_time + s_epochTicks; // first quantum of time of next epoch
+	if (m_simulationEngine == SimulationEngine::ActivePhotons)
+	{
+		emitTime % 2 ? MergeHaloPhotons<SimulationEngine::ActivePhotons, 1>(emitTime) : MergeHaloPhotons<SimulationEngine::ActivePhotons, 0>(emitTime);
+	}
+	else
+	{
+		emitTime % 2 ? MergeHaloPhotons<SimulationEngine::BoxSweep, 1>(emitTime) : MergeHaloPhotons<SimulationEngine::BoxSweep, 0>(emitTime);
+	}
 }
 
-PPh::VectorInt32Math GetObserverPosition(const class Observer *observer)
+void UpdateCullingObserverPositions()
 {
-	assert(s_observers.size() > observer->m_index);
-	VectorInt32Math pos = s_observers[observer->m_index].m_position;
-	return pos;
+	if (!s_bEnergyHorizonCulling)
+	{
+		return;
+	}
+	s_cullingObserverPositions.clear();
+	for (const ObserverCell &observer : s_observers)
+	{
+		s_cullingObserverPositions.push_back(observer.m_position);
+	}
 }
 
-/*void ClearReceivedPhotons(const Observer *observer)
+void InvalidateEmptyDistances(const VectorInt32Math &pos)
 {
-	assert(s_observers.size() > observer->m_index);
-	VectorInt32Math pos = s_observers[observer->m_index].m_position;
-	EtherCell &cell = s_universe[pos.m_posX][pos.m_posY][pos.m_posZ];
-	int isTimeOdd = (s_time) % 2;
-	EtherCellPhotonArray &photonArray = cell.m_photons[isTimeOdd];
-	for (Photon &photon : photonArray)
+	BoxIntMath &box = s_emptyDistancesDirtyBox;
+	if (box.m_minVector.m_posX >= box.m_maxVector.m_posX)
 	{
-		if (photon.m_param2 == observer->m_index)
-		{
-			photon.m_color.m_colorA = 0;
-		}
+		box = BoxIntMath(pos, pos + VectorInt32Math::OneVector);
+		return;
+	}
+	for (int32_t axis = 0; axis < 3; ++axis)
+	{
+		box.m_minVector.m_posArray[axis] = std::min(box.m_minVector.m_posArray[axis], pos.m_posArray[axis]);
+		box.m_maxVector.m_posArray[axis] = std::max(box.m_maxVector.m_posArray[axis], pos.m_posArray[axis] + 1);
 	}
-}*/
-
-void AdjustSizeByBounds(VectorInt32Math &size)
-{
-	const VectorInt32Math &universeSize = GetUniverseSize();
-	size.m_posX = std::max(0, size.m_posX);
-	size.m_posY = std::max(0, size.m_posY);
-	size.m_posZ = std::max(0, size.m_posZ);
-
-	size.m_posX = std::min(universeSize.m_posX, size.m_posX);
-	size.m_posY = std::min(universeSize.m_posY, size.m_posY);
-	size.m_posZ = std::min(universeSize.m_posZ, size.m_posZ);
 }
 
-PPh::VectorInt32Math GetRandomEmptyCell()
+// Distances of cells near dirty box are recomputed from geometry around them by separable passes along Z, Y and X:
+// distance = min over shift k of max(abs(k), distance computed by previous passes at shift k)
+void UpdateEmptyDistances()
 {
-	for (int ii=0; ii<10000; ++ii)
+	const BoxIntMath &dirtyBox = s_emptyDistancesDirtyBox;
+	if (!s_emptyDistances || dirtyBox.m_minVector.m_posX >= dirtyBox.m_maxVector.m_posX)
 	{
-		int32_t posX = Rand32(m_universeSize.m_posX);
-		int32_t posY = Rand32(m_universeSize.m_posY);
-		int32_t posZ = Rand32(m_universeSize.m_posZ);
-		VectorInt32Math pos(posX, posY, posZ);
-		if (CanDaphniaMoveToNextCell(pos))
+		return;
+	}
+	BoxIntMath updateBox, sourceBox; // cells which distance could change and cells which affect them
+	for (int32_t axis = 0; axis < 3; ++axis)
+	{
+		updateBox.m_minVector.m_posArray[axis] = std::max(dirtyBox.m_minVector.m_posArray[axis] - EMPTY_DISTANCE_MAX, 0);
+		updateBox.m_maxVector.m_posArray[axis] = std::min(dirtyBox.m_maxVector.m_posArray[axis] + EMPTY_DISTANCE_MAX, m_universeSize.m_posArray[axis]);
+		sourceBox.m_minVector.m_posArray[axis] = std::max(updateBox.m_minVector.m_posArray[axis] - EMPTY_DISTANCE_MAX, 0);
+		sourceBox.m_maxVector.m_posArray[axis] = std::min(updateBox.m_maxVector.m_posArray[axis] + EMPTY_DISTANCE_MAX, m_universeSize.m_posArray[axis]);
+	}
+	s_emptyDistancesDirtyBox = BoxIntMath();
+	VectorInt32Math size = sourceBox.m_maxVector - sourceBox.m_minVector;
+	auto getLocalIndex = [&size](int32_t posX, int32_t posY, int32_t posZ) { return ((size_t)posX * size.m_posY + posY) * size.m_posZ + posZ; };
+	std::vector<uint8_t> distances((size_t)size.m_posX * size.m_posY * size.m_posZ);
+	for (int32_t posX = 0; posX < size.m_posX; ++posX)
+	{
+		for (int32_t posY = 0; posY < size.m_posY; ++posY)
 		{
-			return VectorInt32Math(posX, posY, posZ);
+			for (int32_t posZ = 0; posZ < size.m_posZ; ++posZ)
+			{
+				int32_t cellIndex = GetCellIndex(sourceBox.m_minVector + VectorInt32Math(posX, posY, posZ));
+				distances[getLocalIndex(posX, posY, posZ)] = GetEtherType(cellIndex) == EtherType::Space ? EMPTY_DISTANCE_MAX : 0;
+			}
 		}
 	}
-	assert(false);
-	return VectorInt32Math::ZeroVector;
-}
-
-bool InitEtherCell(const VectorInt32Math &pos, EtherType::EEtherType type, const EtherColor &color)
-{
-	if (s_universe.size() > pos.m_posX)
+	std::vector<uint8_t> line(std::max(size.m_posX, std::max(size.m_posY, size.m_posZ)));
+	for (int32_t axis = 2; axis >= 0; --axis)
 	{
-		if (s_universe[pos.m_posX].size() > pos.m_posY)
+		int32_t axis1 = (axis + 1) % 3, axis2 = (axis + 2) % 3;
+		int32_t length = size.m_posArray[axis];
+		for (int32_t pos1 = 0; pos1 < size.m_posArray[axis1]; ++pos1)
 		{
-			if (s_universe[pos.m_posX][pos.m_posY].size() > pos.m_posZ)
+			for (int32_t pos2 = 0; pos2 < size.m_posArray[axis2]; ++pos2)
 			{
-				EtherCell &cell = s_universe[pos.m_posX][pos.m_posY][pos.m_posZ];
-				cell.m_type = type;
-				cell.m_color = color;
-				for (int ii = 0; ii < cell.m_photons[0].size(); ++ii)
+				VectorInt32Math pos;
+				pos.m_posArray[axis1] = pos1;
+				pos.m_posArray[axis2] = pos2;
+				for (int32_t ii = 0; ii < length; ++ii)
 				{
-					Photon &photon = cell.m_photons[0][ii];
-					photon.m_color = EtherColor::ZeroColor;
+					pos.m_posArray[axis] = ii;
+					line[ii] = distances[getLocalIndex(pos.m_posX, pos.m_posY, pos.m_posZ)];
 				}
-				for (int ii = 0; ii < cell.m_photons[1].size(); ++ii)
+				for (int32_t ii = 0; ii < length; ++ii)
 				{
-					Photon &photon = cell.m_photons[1][ii];
-					photon.m_color = EtherColor::ZeroColor;
+					int32_t distance = line[ii];
+					for (int32_t shift = 1; shift < distance; ++shift) // max(shift, x) >= shift
+					{
+						if (ii >= shift)
+						{
+							distance = std::min(distance, std::max<int32_t>(shift, line[ii - shift]));
+						}
+						if (ii + shift < length)
+						{
+							distance = std::min(distance, std::max<int32_t>(shift, line[ii + shift]));
+						}
+					}
+					pos.m_posArray[axis] = ii;
+					distances[getLocalIndex(pos.m_posX, pos.m_posY, pos.m_posZ)] = (uint8_t)distance;
 				}
-				return true;
 			}
 		}
 	}
-	return false;
-}
-
-bool EmitPhoton(const VectorInt32Math &pos, const Photon &photon)
-{
-	VectorInt32Math unitVector = CalculatePositionShift(pos, photon.m_orientation);
-	VectorInt32Math nextPos = pos + unitVector;
-	if (IsPosInBounds(nextPos))
+	for (int32_t posX = updateBox.m_minVector.m_posX; posX < updateBox.m_maxVector.m_posX; ++posX)
 	{
-		int isTimeOdd = (s_time + 1) % 2; // will be handle on next quantum of time
-
-		EtherCell &cell = s_universe[nextPos.m_posX][nextPos.m_posY][nextPos.m_posZ];
-		int32_t cellPhotonIndex = GetCellPhotonIndex(unitVector);
-		Photon &photonCell = cell.m_photons[isTimeOdd][cellPhotonIndex];
-		if (photonCell.m_color.m_colorA > 0)
+		for (int32_t posY = updateBox.m_minVector.m_posY; posY < updateBox.m_maxVector.m_posY; ++posY)
 		{
-			if (Rand32(2))
+			for (int32_t posZ = updateBox.m_minVector.m_posZ; posZ < updateBox.m_maxVector.m_posZ; ++posZ)
 			{
-				return false;
+				VectorInt32Math pos(posX, posY, posZ);
+				VectorInt32Math localPos = pos - sourceBox.m_minVector;
+				s_emptyDistances[GetCellIndex(pos)] = distances[getLocalIndex(localPos.m_posX, localPos.m_posY, localPos.m_posZ)];
 			}
 		}
-		photonCell = photon;
 	}
-	
-	return true;
 }
 
 VectorInt32Math DestroyCrumb(VectorInt32Math cellPos, bool isResetMinCellPos)
@@ -926,10 +3364,11 @@ VectorInt32Math DestroyCrumb(VectorInt32Math cellPos, bool isResetMinCellPos)
 		minCellPos = cellPos;
 	}
 
-	EtherCell &cell = s_universe[cellPos.m_posX][cellPos.m_posY][cellPos.m_posZ];
-	if (cell.m_type == EtherType::Crumb)
+	int32_t cellIndex = GetCellIndex(cellPos);
+	if (GetEtherType(cellIndex) == EtherType::Crumb)
 	{
-		cell.m_type = EtherType::Space;
+		SetEtherType(cellIndex, EtherType::Space);
+		InvalidateEmptyDistances(cellPos);
 		minCellPos.m_posX = std::min(minCellPos.m_posX, cellPos.m_posX);
 		minCellPos.m_posY = std::min(minCellPos.m_posY, cellPos.m_posY);
 		minCellPos.m_posZ = std::min(minCellPos.m_posZ, cellPos.m_posZ);
@@ -959,6 +3398,11 @@ uint32_t GetFPS()
 	return m_quantumOfTimePerSecond;
 }
 
+uint64_t GetCulledPhotonStepsPerSecond()
+{
+	return m_culledPhotonStepsPerSecond;
+}
+
 bool IsHighPrecisionStatsEnabled()
 {
 #ifdef HIGH_PRECISION_STATS
@@ -977,6 +3421,29 @@ std::vector<uint32_t> GetTickTimeMusUniverseThreads()
 {
 	return m_TickTimeMusAverageUniverseThreads;
 }
+
+std::vector<uint32_t> GetBarrierWaitMusThreads()
+{
+	return m_barrierWaitMusAverage;
+}
+
+uint32_t GetActiveUniverseThreadsCount()
+{
+	return s_activeThreadsCount;
+}
+
+std::vector<uint16_t> GetThreadCpus()
+{
+	std::vector<uint16_t> threadCpus;
+	if (s_bPinThreads)
+	{
+		for (const PROCESSOR_NUMBER &cpu : s_threadCpus)
+		{
+			threadCpus.push_back(cpu.Group * 64 + cpu.Number);
+		}
+	}
+	return threadCpus;
+}
 //-----------------------------------------------------------------------------------------------------------------------------
 //----------------------------------------------------------- Helpers ---------------------------------------------------------
 //-----------------------------------------------------------------------------------------------------------------------------
@@ -1009,8 +3476,7 @@ bool CanDaphniaMoveToNextCell(const VectorInt32Math &pos, const VectorInt32Math
 {
 	VectorInt32Math nextPos = pos + unitVector;
 
-	EtherCell &cell = s_universe[pos.m_posX][pos.m_posY][pos.m_posZ];
-	EtherCell &nextCell = s_universe[nextPos.m_posX][nextPos.m_posY][nextPos.m_posZ];
+	int32_t cellIndex = GetCellIndex(pos);
 
 	VectorInt32Math bigDaphniaVector = VectorInt32Math::ZeroVector;
 	if (IS_DAPHNIA_BIG)
@@ -1020,36 +3486,32 @@ bool CanDaphniaMoveToNextCell(const VectorInt32Math &pos, const VectorInt32Math
 
 	if (IsPosInBounds(nextPos + bigDaphniaVector))
 	{
+		int32_t nextCellIndex = GetCellIndex(nextPos);
 		if (IS_DAPHNIA_BIG)
 		{
-			for (int32_t xx = -1; xx < 2; ++xx)
+			for (int32_t ii = -1; ii < 26; ++ii) // -1 is central cell
 			{
-				for (int32_t yy = -1; yy < 2; ++yy)
+				int32_t curNextCellIndex = ii < 0 ? nextCellIndex : GetCellIndex(nextPos + GetUnitVectorFromPhotonIndex(ii));
+				int32_t curNextCellType = GetEtherType(curNextCellIndex);
+				if (curNextCellType != EtherType::Space && curNextCellType != EtherType::Crumb &&
+					!(curNextCellType == EtherType::Observer && GetEtherColor(curNextCellIndex).m_colorA == GetEtherColor(cellIndex).m_colorA))
 				{
-					for (int32_t zz = -1; zz < 2; ++zz)
-					{
-						VectorInt32Math curNextPos = VectorInt32Math(nextPos.m_posX + xx, nextPos.m_posY + yy, nextPos.m_posZ + zz);
-						EtherCell &curNextCell = s_universe[curNextPos.m_posX][curNextPos.m_posY][curNextPos.m_posZ];
-						if (curNextCell.m_type != EtherType::Space && curNextCell.m_type != EtherType::Crumb &&
-							!(curNextCell.m_type == EtherType::Observer && curNextCell.m_color.m_colorA == cell.m_color.m_colorA))
-						{
-							return false;
-						}
-						if (curNextCell.m_type == EtherType::Crumb)
-						{
-							outCrumbPos = curNextPos;
-						}
-					}
+					return false;
+				}
+				if (curNextCellType == EtherType::Crumb)
+				{
+					outCrumbPos = ii < 0 ? nextPos : nextPos + GetUnitVectorFromPhotonIndex(ii);
 				}
 			}
 		}
 		else
 		{
-			if (nextCell.m_type != EtherType::Space && nextCell.m_type != EtherType::Crumb)
+			int32_t nextCellType = GetEtherType(nextCellIndex);
+			if (nextCellType != EtherType::Space && nextCellType != EtherType::Crumb)
 			{
 				return false;
 			}
-			if (nextCell.m_type == EtherType::Crumb)
+			if (nextCellType == EtherType::Crumb)
 			{
 				outCrumbPos = nextPos;
 			}
@@ -1067,54 +3529,41 @@ void MoveDaphniaToNextCell(const VectorInt32Math &pos, const VectorInt32Math &un
 {
 	VectorInt32Math nextPos = pos + unitVector;
 
-	EtherCell &cell = s_universe[pos.m_posX][pos.m_posY][pos.m_posZ];
-	EtherCell &nextCell = s_universe[nextPos.m_posX][nextPos.m_posY][nextPos.m_posZ];
-
-	EtherColor daphniaColorAndIndex = cell.m_color;
+	int32_t cellIndex = GetCellIndex(pos);
+	int32_t nextCellIndex = GetCellIndex(nextPos);
+	uint8_t daphniaColorAndIndex = s_etherColors[cellIndex];
+	InvalidateEmptyDistances(pos - VectorInt32Math::OneVector); // big daphnia in both cells
+	InvalidateEmptyDistances(pos + VectorInt32Math::OneVector);
+	InvalidateEmptyDistances(nextPos - VectorInt32Math::OneVector);
+	InvalidateEmptyDistances(nextPos + VectorInt32Math::OneVector);
 
 	if (IS_DAPHNIA_BIG)
 	{
 		// erase Daphnia
-		for (int32_t xx = -1; xx < 2; ++xx)
+		for (int32_t ii = -1; ii < 26; ++ii) // -1 is central cell
 		{
-			for (int32_t yy = -1; yy < 2; ++yy)
-			{
-				for (int32_t zz = -1; zz < 2; ++zz)
-				{
-					VectorInt32Math curPos = VectorInt32Math(pos.m_posX + xx, pos.m_posY + yy, pos.m_posZ + zz);
-					EtherCell &curCell = s_universe[curPos.m_posX][curPos.m_posY][curPos.m_posZ];
-					curCell.m_type = EtherType::Space;
-				}
-			}
+			VectorInt32Math curPos = ii < 0 ? pos : pos + GetUnitVectorFromPhotonIndex(ii);
+			int32_t curCellIndex = GetCellIndex(curPos);
+			SetEtherType(curCellIndex, EtherType::Space);
+			ActivateVacatedCell(curCellIndex);
 		}
 		// move Daphnia
-		for (int32_t xx = -1; xx < 2; ++xx)
+		int32_t isTimeOdd = (s_time + s_epochTicks) % 2;
+		for (int32_t ii = -1; ii < 26; ++ii) // -1 is central cell
 		{
-			for (int32_t yy = -1; yy < 2; ++yy)
-			{
-				for (int32_t zz = -1; zz < 2; ++zz)
-				{
-					VectorInt32Math curNextPos = VectorInt32Math(nextPos.m_posX + xx, nextPos.m_posY + yy, nextPos.m_posZ + zz);
-					EtherCell &curNextCell = s_universe[curNextPos.m_posX][curNextPos.m_posY][curNextPos.m_posZ];
-					curNextCell.m_type = EtherType::Observer;
-					curNextCell.m_color = daphniaColorAndIndex;
-					// clear photons (prevent to receive photons emitted in previous quantum of time)
-					int32_t isTimeOdd = (s_time + 1) % 2;
-					{
-						for (int ii = 0; ii < cell.m_photons[isTimeOdd].size(); ++ii)
-						{
-							curNextCell.m_photons[isTimeOdd][ii].m_color.m_colorA = 0;
-						}
-					}
-				}
-			}
+			int32_t curNextCellIndex = ii < 0 ? nextCellIndex : GetCellIndex(nextPos + GetUnitVectorFromPhotonIndex(ii));
+			SetEtherType(curNextCellIndex, EtherType::Observer);
+			s_etherColors[curNextCellIndex] = daphniaColorAndIndex;
+			// clear photons (prevent to receive photons emitted in previous quantum of time)
+			GetEtherPhotonsMask(curNextCellIndex, isTimeOdd).store(0, std::memory_order_relaxed);
 		}
 	}
 	else
 	{
-		cell.m_type = EtherType::Space;
-		nextCell.m_type = EtherType::Observer;
-		nextCell.m_color = daphniaColorAndIndex;
+		SetEtherType(cellIndex, EtherType::Space);
+		ActivateVacatedCell(cellIndex);
+		SetEtherType(nextCellIndex, EtherType::Observer);
+		s_etherColors[nextCellIndex] = daphniaColorAndIndex;
 	}
 }
 
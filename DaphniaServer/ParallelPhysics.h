@@ -1,6 +1,7 @@
 #pragma once
 
 #include "PPhHelpers.h"
+#include "PhotonKernel.h"
 #include "memory"
 #include "array"
 #include "vector"
@@ -12,6 +13,7 @@ constexpr bool IS_DAPHNIA_BIG = true; // big Daphnia is 3x3x3
 
 // Typedefs
 typedef std::array<Photon, 26> EtherCellPhotonArray;
+typedef std::array<EtherCellPhotonArray, 2> EtherCellPhotons; // photons of current and next quantum of time
 
 // Forward declarations
 class Observer;
@@ -19,7 +21,42 @@ class MsgBase;
 
 namespace ParallelPhysics
 {
-	bool Init(const VectorInt32Math &universeSize, uint8_t threadsCount, uint32_t universeScale); // returns true if success. threadsCount 0 means simulate near observer
+	enum class SimulationEngine
+	{
+		BoxSweep = 0, // sweep every cell of universe threads bounds
+		ActivePhotons, // visit only cells which hold photons. Simulates whole universe
+		Gather, // like BoxSweep, but every cell pulls photons from neighbours, threads write only to own cells
+		Streaming // like Gather, but photons of one direction move together as shifted plane, forces DirectionPlanes storage
+	};
+
+	enum class PhotonStorage
+	{
+		CellSlots = 0, // 26 photons of cell lie together
+		DirectionPlanes // photons of one direction lie together for all cells of brick
+	};
+
+	struct SimulationParams
+	{
+		SimulationEngine m_engine = SimulationEngine::BoxSweep;
+		bool m_bLargePages = false; // back photon bricks by large pages, needs SeLockMemoryPrivilege
+		bool m_bNumaPlacement = false; // bind universe threads to NUMA nodes and place ether of their X slabs on that nodes
+		uint64_t m_randomSeed = 0; // 0 means random seed, see GetRandomSeed to reproduce run with same threads count
+		PhotonKernel::KernelType m_photonKernel = PhotonKernel::KernelType::Auto;
+		PhotonKernel::StepMode m_photonStepMode = PhotonKernel::StepMode::Random;
+		bool m_bCheckStepMode = false; // statistical check of Table or Dda step mode against Random stepping, diagnostics only
+		PhotonStorage m_photonStorage = PhotonStorage::CellSlots;
+		bool m_bSinglePhotonBuffer = false; // both quantum of time parities share photon slots, halves bricks. Push engines only
+		bool m_bPhotonJumps = false; // photons far from geometry jump several cells per step by distance field. Push engines only
+		bool m_bEnergyHorizonCulling = false; // drop photons which weaken to zero before they could reach any observer
+		uint32_t m_farFieldPeriod = 0; // cells outside of near boxes are stepped once per this quantums of time, 0 means not simulated. Box sweep only
+		bool m_bRayCastEcholocation = false; // echolocation photons are ray-marched through geometry by observers thread instead of ether
+		uint32_t m_epochTicks = 1; // quantums of time universe threads simulate between tick barriers, observers tick once per epoch. Box sweep only
+		bool m_bAdaptiveThreads = false; // count of active universe threads follows measured cost of quantum of time, the rest are parked
+		bool m_bPinThreads = false; // pin every universe thread and observers thread to own core, neighbour X slabs share L3 cache
+	};
+
+	bool Init(const VectorInt32Math &universeSize, uint8_t threadsCount, uint32_t universeScale,
+		const SimulationParams &params = SimulationParams()); // returns true if success. threadsCount 0 means simulate near observer
 	uint32_t GetUniverseScale();
 	bool SaveUniverse(const std::string &fileName);
 	bool LoadUniverse(const std::string &fileName);
@@ -39,14 +76,19 @@ namespace ParallelPhysics
 	const char* RecvClientMsg(const Observer *observer); // returns nullptr if error occur
 	void SendClientMsg(const Observer *observer, const MsgBase &msg, int32_t msgSize);
 	void HandleOtherObserversPhotons(const Observer *observer); // should be called from observers thread
-	EtherCellPhotonArray& GetReceivedPhotons(const Observer *observer);
-	EtherCellPhotonArray& GetReceivedPhotonsForBigDaphnia(const Observer *observer, uint32_t index /*0-26*/);
+	// Copy received photons to outPhotons and remove them from ether. Returns bit mask of copied photons
+	uint32_t GrabReceivedPhotons(const Observer *observer, EtherCellPhotonArray &outPhotons);
+	uint32_t GrabReceivedPhotonsForBigDaphnia(const Observer *observer, uint32_t index /*0-26*/, EtherCellPhotonArray &outPhotons);
 	VectorInt32Math GetObserverPosition(const Observer *observer);
 	// Stats
 	uint32_t GetFPS();
+	uint64_t GetCulledPhotonStepsPerSecond(); // photon steps saved by energy horizon culling
 	bool IsHighPrecisionStatsEnabled();
 	uint32_t GetTickTimeMusObserverThread(); // average tick time in microseconds
 	std::vector<uint32_t> GetTickTimeMusUniverseThreads(); // average tick time in microseconds
+	std::vector<uint32_t> GetBarrierWaitMusThreads(); // average wait at tick barriers per quantum of time in microseconds, universe threads and observers thread
+	uint32_t GetActiveUniverseThreadsCount(); // universe threads which take part in quantum of time, they are first in GetTickTimeMusUniverseThreads
+	std::vector<uint16_t> GetThreadCpus(); // group * 64 + number of logical processor for universe threads and observers thread (last), empty if not pinned
 };
 
 }
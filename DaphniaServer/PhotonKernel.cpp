@@ -0,0 +1,492 @@
+
+#include "PhotonKernel.h"
+#include "algorithm"
+#include "atomic"
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <math.h>
+#include <immintrin.h>
+
+namespace PPh
+{
+namespace PhotonKernel
+{
+// -----------------------------------------------------------------------------------
+// ----------------------------------- Variables -------------------------------------
+// -----------------------------------------------------------------------------------
+typedef void(*StepCellPhotonsFunc)(CellPhotonsStep &step);
+
+void StepCellPhotonsScalar(CellPhotonsStep &step);
+void StepCellPhotonsAvx2(CellPhotonsStep &step);
+void StepCellPhotonsCompare(CellPhotonsStep &step);
+
+StepCellPhotonsFunc s_stepCellPhotons = StepCellPhotonsScalar;
+KernelType s_kernelType = KernelType::Scalar;
+std::atomic<uint64_t> s_compareMismatches = 0;
+constexpr uint64_t MAX_PRINTED_MISMATCHES = 16;
+
+typedef std::array<std::array<uint32_t, STEP_PERIOD / 32>, STEP_PERIOD> StepPatterns; // bit per step phase for every abs(orientation)
+std::array<StepPatterns, 3> s_stepPatterns; // for every axis
+constexpr uint32_t STEP_PHASE_BITS = 7;
+static_assert(STEP_PERIOD == 1 << STEP_PHASE_BITS && STEP_PERIOD / 32 == 4, "Avx2 kernel indexes s_stepPatterns by 4 dwords per orientation");
+
+static_assert(sizeof(Photon) == 12 && offsetof(Photon, m_color) == 0 && offsetof(Photon, m_orientation) == 4 && offsetof(Photon, m_param) == 8 &&
+	offsetof(Photon, m_stepPhase) == 10, "Avx2 kernel gathers photon as 3 dwords");
+
+// -----------------------------------------------------------------------------------
+// ----------------------------------- Functions -------------------------------------
+// -----------------------------------------------------------------------------------
+bool IsAvx2Supported()
+{
+	int cpuInfo[4];
+	__cpuid(cpuInfo, 0);
+	if (cpuInfo[0] < 7)
+	{
+		return false;
+	}
+	__cpuid(cpuInfo, 1);
+	bool bOsxsave = (cpuInfo[2] & (1 << 27)) != 0;
+	bool bAvx = (cpuInfo[2] & (1 << 28)) != 0;
+	if (!bOsxsave || !bAvx || (_xgetbv(0) & 6) != 6) // OS saves xmm and ymm registers
+	{
+		return false;
+	}
+	__cpuidex(cpuInfo, 7, 0);
+	return (cpuInfo[1] & (1 << 5)) != 0;
+}
+
+// Bresenham: axis steps when accumulated error phase * (abs(orientation) + 1) crosses STEP_PERIOD
+__forceinline bool IsDdaStep(uint32_t absOrient, uint32_t phase)
+{
+	uint32_t stepsPerPeriod = absOrient + 1;
+	return ((phase * stepsPerPeriod) & STEP_PHASE_MASK) + stepsPerPeriod >= STEP_PERIOD;
+}
+
+// Axis steps at phase if rank of phase < abs(orientation) + 1. Ranks of axes are first 3 dimensions of Sobol sequence,
+// so every axis steps evenly along the period and steps of different axes are close to independent as in StepMode::Random
+void InitStepPatterns()
+{
+	constexpr std::array<uint32_t, 3> POLYNOMIAL_DEGREES = { 0, 1, 2 }; // primitive polynomials: van der Corput, x + 1, x^2 + x + 1
+	for (uint32_t axis = 0; axis < 3; ++axis)
+	{
+		std::array<uint32_t, STEP_PHASE_BITS> directions; // direction numbers, m_k << (STEP_PHASE_BITS - k)
+		for (uint32_t bit = 0; bit < STEP_PHASE_BITS; ++bit)
+		{
+			uint32_t degree = POLYNOMIAL_DEGREES[axis];
+			uint32_t directionM = 1;
+			if (degree == 1 && bit >= 1)
+			{
+				uint32_t prevM = directions[bit - 1] >> (STEP_PHASE_BITS - bit);
+				directionM = (prevM << 1) ^ prevM;
+			}
+			else if (degree == 2 && bit == 1)
+			{
+				directionM = 3;
+			}
+			else if (degree == 2 && bit >= 2)
+			{
+				uint32_t prevM = directions[bit - 1] >> (STEP_PHASE_BITS - bit);
+				uint32_t prevM2 = directions[bit - 2] >> (STEP_PHASE_BITS - bit + 1);
+				directionM = (prevM << 1) ^ (prevM2 << 2) ^ prevM2;
+			}
+			directions[bit] = directionM << (STEP_PHASE_BITS - 1 - bit);
+		}
+		for (StepPatterns::value_type &pattern : s_stepPatterns[axis])
+		{
+			pattern.fill(0);
+		}
+		for (uint32_t phase = 0; phase < STEP_PERIOD; ++phase)
+		{
+			uint32_t rank = 0;
+			for (uint32_t bit = 0; bit < STEP_PHASE_BITS; ++bit)
+			{
+				if (phase & (1 << bit))
+				{
+					rank ^= directions[bit];
+				}
+			}
+			for (uint32_t absOrient = rank; absOrient < STEP_PERIOD; ++absOrient)
+			{
+				s_stepPatterns[axis][absOrient][phase >> 5] |= 1u << (phase & 31);
+			}
+		}
+	}
+}
+
+__forceinline bool IsAxisStep(StepMode mode, int32_t orient, uint32_t phase, uint32_t axis, uint8_t randomByte)
+{
+	uint32_t absOrient = std::min(std::abs(orient), (int32_t)OrientationVectorMath::PPH_INT_MAX);
+	switch (mode)
+	{
+	case StepMode::Table:
+		phase &= STEP_PHASE_MASK;
+		return (s_stepPatterns[axis][absOrient][phase >> 5] >> (phase & 31)) & 1;
+	case StepMode::Dda:
+		return IsDdaStep(absOrient, phase & STEP_PHASE_MASK);
+	default:
+		return absOrient >= (uint32_t)(randomByte & OrientationVectorMath::PPH_INT_MAX);
+	}
+}
+
+bool Init(KernelType type)
+{
+	InitStepPatterns();
+	bool bAvx2 = IsAvx2Supported();
+	if (type == KernelType::Auto)
+	{
+		type = bAvx2 ? KernelType::Avx2 : KernelType::Scalar;
+	}
+	if ((type == KernelType::Avx2 || type == KernelType::Compare) && !bAvx2)
+	{
+		s_kernelType = KernelType::Scalar;
+		s_stepCellPhotons = StepCellPhotonsScalar;
+		return false;
+	}
+	s_kernelType = type;
+	switch (type)
+	{
+	case KernelType::Avx2:
+		s_stepCellPhotons = StepCellPhotonsAvx2;
+		break;
+	case KernelType::Compare:
+		s_stepCellPhotons = StepCellPhotonsCompare;
+		break;
+	default:
+		s_stepCellPhotons = StepCellPhotonsScalar;
+		break;
+	}
+	return true;
+}
+
+const char* GetKernelName()
+{
+	switch (s_kernelType)
+	{
+	case KernelType::Avx2:
+		return "avx2";
+	case KernelType::Compare:
+		return "avx2 compared with scalar and PhotonStepForward";
+	default:
+		return "scalar";
+	}
+}
+
+uint64_t GetCompareMismatches()
+{
+	return s_compareMismatches;
+}
+
+bool IsCompareKernel()
+{
+	return s_kernelType == KernelType::Compare;
+}
+
+void ReportCompareMismatch(const char *reference, uint32_t photonsMask)
+{
+	uint64_t mismatches = ++s_compareMismatches;
+	if (mismatches <= MAX_PRINTED_MISMATCHES)
+	{
+		printf("Photon kernel mismatch with %s: photons mask %x\n", reference, photonsMask);
+	}
+}
+
+void StepCellPhotons(CellPhotonsStep &step)
+{
+	s_stepCellPhotons(step);
+}
+
+VectorInt8Math StepPhoton(StepMode mode, Photon &photon)
+{
+	VectorInt8Math unitVector = VectorInt8Math::ZeroVector;
+	for (uint32_t axis = 0; axis < 3; ++axis)
+	{
+		int32_t orient = photon.m_orientation.m_posArray[axis];
+		uint8_t randomByte = mode == StepMode::Random ? t_randomStream.NextByte() : 0;
+		if (IsAxisStep(mode, orient, photon.m_stepPhase, axis, randomByte))
+		{
+			unitVector.m_posArray[axis] = (int8_t)Sign(orient);
+		}
+	}
+	++photon.m_stepPhase;
+	return unitVector;
+}
+
+const char* GetStepModeName(StepMode mode)
+{
+	switch (mode)
+	{
+	case StepMode::Table:
+		return "table";
+	case StepMode::Dda:
+		return "dda";
+	default:
+		return "random";
+	}
+}
+
+bool CheckStepMode(StepMode mode)
+{
+	constexpr int32_t ORIENTATION_STEP = 4;
+	const uint32_t stepsCount = mode == StepMode::Random ? 64 * STEP_PERIOD : STEP_PERIOD; // deterministic modes repeat every period
+	// deterministic modes should match expected mean exactly, random one within 5 sigma
+	const double meanTolerance = mode == StepMode::Random ? 5 * 0.5 / sqrt((double)stepsCount) : 1e-9;
+	double maxMeanError = 0, maxAngleError = 0, maxDistance = 0;
+	bool bMeanMatches = true;
+	// orientations are maximized as ones of daphnia eyes, one component is PPH_INT_MAX
+	for (int32_t orientY = OrientationVectorMath::PPH_INT_MIN; orientY <= OrientationVectorMath::PPH_INT_MAX; orientY += ORIENTATION_STEP)
+	{
+		for (int32_t orientZ = OrientationVectorMath::PPH_INT_MIN; orientZ <= OrientationVectorMath::PPH_INT_MAX; orientZ += ORIENTATION_STEP)
+		{
+			Photon photon(OrientationVectorMath(OrientationVectorMath::PPH_INT_MAX, (int8_t)orientY, (int8_t)orientZ));
+			std::array<uint32_t, 27> directionCounts = {};
+			std::array<double, 3> shiftSum = {};
+			for (uint32_t ii = 0; ii < stepsCount; ++ii)
+			{
+				VectorInt8Math unitVector = StepPhoton(mode, photon);
+				++directionCounts[(unitVector.m_posX + 1) * 9 + (unitVector.m_posY + 1) * 3 + (unitVector.m_posZ + 1)];
+				for (uint32_t axis = 0; axis < 3; ++axis)
+				{
+					shiftSum[axis] += unitVector.m_posArray[axis];
+				}
+			}
+			// StepMode::Random: axes step independently with probability (abs(orientation) + 1) / STEP_PERIOD
+			std::array<double, 3> stepProbabilities, mean, expectedMean;
+			double dot = 0, meanLength = 0, expectedLength = 0;
+			for (uint32_t axis = 0; axis < 3; ++axis)
+			{
+				int32_t orient = photon.m_orientation.m_posArray[axis];
+				stepProbabilities[axis] = orient ? (std::min(std::abs(orient), (int32_t)OrientationVectorMath::PPH_INT_MAX) + 1) / (double)STEP_PERIOD : 0;
+				expectedMean[axis] = Sign(orient) * stepProbabilities[axis];
+				mean[axis] = shiftSum[axis] / stepsCount;
+				double meanError = fabs(mean[axis] - expectedMean[axis]);
+				maxMeanError = std::max(maxMeanError, meanError);
+				bMeanMatches = bMeanMatches && meanError <= meanTolerance;
+				dot += mean[axis] * expectedMean[axis];
+				meanLength += mean[axis] * mean[axis];
+				expectedLength += expectedMean[axis] * expectedMean[axis];
+			}
+			double cosAngle = std::min(1.0, dot / sqrt(meanLength * expectedLength));
+			maxAngleError = std::max(maxAngleError, acos(cosAngle) * 180.0 / 3.14159265358979);
+			// total variation distance between shift directions and independent axes of StepMode::Random
+			double distance = 0;
+			for (int32_t direction = 0; direction < 27; ++direction)
+			{
+				std::array<int32_t, 3> shift = { direction / 9 - 1, direction / 3 % 3 - 1, direction % 3 - 1 };
+				double probability = 1;
+				for (uint32_t axis = 0; axis < 3; ++axis)
+				{
+					int32_t sign = Sign(photon.m_orientation.m_posArray[axis]);
+					probability *= shift[axis] == 0 ? 1 - stepProbabilities[axis] : (shift[axis] == sign ? stepProbabilities[axis] : 0);
+				}
+				distance += fabs(directionCounts[direction] / (double)stepsCount - probability);
+			}
+			maxDistance = std::max(maxDistance, distance / 2);
+		}
+	}
+	printf("Photon step mode %s check: max mean shift error %.4f, max angle error %.3f deg, max shift distribution distance %.3f\n",
+		GetStepModeName(mode), maxMeanError, maxAngleError, maxDistance);
+	return bMeanMatches;
+}
+
+// same math as PhotonStepForward and StepPhoton
+void StepCellPhotonsScalar(CellPhotonsStep &step)
+{
+	uint32_t count = 0;
+	uint32_t aliveMask = 0;
+	for (uint32_t mask = step.m_photonsMask; mask; mask &= mask - 1, ++count)
+	{
+		Photon photon = step.m_photons[CountTrailingZeros(mask) * step.m_photonsStride];
+		if (step.m_bReflect)
+		{
+			photon.m_orientation *= -1;
+			uint8_t tmpA = photon.m_color.m_colorA;
+			photon.m_color = step.m_cellColor;
+			photon.m_color.m_colorA = tmpA;
+		}
+		if (photon.m_color.m_colorA > step.m_weakening)
+		{
+			photon.m_color.m_colorA -= step.m_weakening;
+			aliveMask |= 1 << count;
+		}
+		VectorInt8Math unitVector = VectorInt8Math::ZeroVector;
+		for (uint32_t axis = 0; axis < 3; ++axis)
+		{
+			int32_t orient = photon.m_orientation.m_posArray[axis];
+			if (IsAxisStep(step.m_stepMode, orient, photon.m_stepPhase, axis, step.m_randomBytes[axis][count]))
+			{
+				unitVector.m_posArray[axis] = (int8_t)Sign(orient);
+			}
+		}
+		++photon.m_stepPhase;
+		int32_t photonIndex = (unitVector.m_posX + 1) * 9 + (unitVector.m_posY + 1) * 3 + (unitVector.m_posZ + 1);
+		if (photonIndex > 13)
+		{
+			--photonIndex;
+		}
+		step.m_outPhotons[count] = photon;
+		step.m_unitVectors[count] = unitVector;
+		step.m_photonIndices[count] = (uint8_t)photonIndex;
+	}
+	step.m_photonsCount = count;
+	step.m_aliveMask = aliveMask;
+}
+
+// lanes are all ones if axis steps
+__forceinline __m256i DdaStepAvx2(__m256i absOrient, __m256i phase)
+{
+	__m256i stepsPerPeriod = _mm256_add_epi32(absOrient, _mm256_set1_epi32(1));
+	__m256i error = _mm256_and_si256(_mm256_mullo_epi32(phase, stepsPerPeriod), _mm256_set1_epi32(STEP_PHASE_MASK));
+	return _mm256_cmpgt_epi32(_mm256_add_epi32(error, stepsPerPeriod), _mm256_set1_epi32(STEP_PHASE_MASK));
+}
+
+__forceinline __m256i TableStepAvx2(__m256i absOrient, __m256i phase, uint32_t axis)
+{
+	__m256i dwordIndex = _mm256_add_epi32(_mm256_slli_epi32(absOrient, 2), _mm256_srli_epi32(phase, 5));
+	__m256i pattern = _mm256_i32gather_epi32(reinterpret_cast<const int*>(s_stepPatterns[axis].data()), dwordIndex, 4);
+	__m256i bit = _mm256_and_si256(_mm256_srlv_epi32(pattern, _mm256_and_si256(phase, _mm256_set1_epi32(31))), _mm256_set1_epi32(1));
+	return _mm256_cmpeq_epi32(bit, _mm256_set1_epi32(1));
+}
+
+// photons are gathered from cell array to 8 lanes, only stores of results are scalar
+void StepCellPhotonsAvx2(CellPhotonsStep &step)
+{
+	alignas(32) std::array<int32_t, BATCH_LANES> slots;
+	uint32_t count = 0;
+	for (uint32_t mask = step.m_photonsMask; mask; mask &= mask - 1)
+	{
+		slots[count++] = CountTrailingZeros(mask);
+	}
+	for (uint32_t ii = count; ii < (count + 7) / 8 * 8; ++ii)
+	{
+		slots[ii] = 0; // tail lanes read first photon and are dropped
+	}
+
+	const int *photonDwords = reinterpret_cast<const int*>(step.m_photons);
+	const __m256i one = _mm256_set1_epi32(1);
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i allOnes = _mm256_set1_epi32(-1);
+	const __m256i randomMask = _mm256_set1_epi32(OrientationVectorMath::PPH_INT_MAX);
+	const __m256i orientMask = _mm256_set1_epi32(0x00FFFFFF); // x y z bytes of OrientationVectorMath
+	const __m256i alphaMask = _mm256_set1_epi32(0xFF000000);
+	const __m256i cellColor = _mm256_set1_epi32(step.m_cellColor.AlignmentDummy & 0x00FFFFFF);
+	const __m256i weakening = _mm256_set1_epi32(step.m_weakening);
+	const __m256i weakeningAlpha = _mm256_set1_epi32((uint32_t)step.m_weakening << 24);
+	const __m256i centralIndex = _mm256_set1_epi32(13);
+	const __m256i slotDwords = _mm256_set1_epi32(step.m_photonsStride * 3);
+	const __m256i maxOrient = _mm256_set1_epi32(OrientationVectorMath::PPH_INT_MAX);
+	const __m256i phaseMask = _mm256_set1_epi32(STEP_PHASE_MASK);
+	const __m256i stepPhaseMask = _mm256_set1_epi32(0x00FF0000); // m_stepPhase byte of param dword
+	const __m256i stepPhaseOne = _mm256_set1_epi32(0x00010000);
+
+	alignas(32) std::array<int32_t, 8> colors, orients, params, unitX, unitY, unitZ, indices;
+	uint32_t aliveMask = 0;
+	for (uint32_t lane = 0; lane < count; lane += 8)
+	{
+		__m256i slot = _mm256_load_si256(reinterpret_cast<const __m256i*>(&slots[lane]));
+		__m256i dwordIndex = _mm256_mullo_epi32(slot, slotDwords);
+		__m256i color = _mm256_i32gather_epi32(photonDwords, dwordIndex, 4);
+		__m256i orient = _mm256_i32gather_epi32(photonDwords + 1, dwordIndex, 4);
+		__m256i param = _mm256_i32gather_epi32(photonDwords + 2, dwordIndex, 4);
+		if (step.m_bReflect)
+		{
+			__m256i negated = _mm256_sub_epi8(zero, orient);
+			orient = _mm256_or_si256(_mm256_and_si256(negated, orientMask), _mm256_andnot_si256(orientMask, orient));
+			color = _mm256_or_si256(_mm256_and_si256(color, alphaMask), cellColor);
+		}
+		__m256i alive = _mm256_cmpgt_epi32(_mm256_srli_epi32(color, 24), weakening);
+		color = _mm256_sub_epi32(color, weakeningAlpha); // alpha is top byte, valid for alive lanes only
+
+		__m256i orientX = _mm256_srai_epi32(_mm256_slli_epi32(orient, 24), 24);
+		__m256i orientY = _mm256_srai_epi32(_mm256_slli_epi32(orient, 16), 24);
+		__m256i orientZ = _mm256_srai_epi32(_mm256_slli_epi32(orient, 8), 24);
+		__m256i absX = _mm256_min_epi32(_mm256_abs_epi32(orientX), maxOrient);
+		__m256i absY = _mm256_min_epi32(_mm256_abs_epi32(orientY), maxOrient);
+		__m256i absZ = _mm256_min_epi32(_mm256_abs_epi32(orientZ), maxOrient);
+		__m256i phase = _mm256_and_si256(_mm256_srli_epi32(param, 16), phaseMask);
+		__m256i stepX, stepY, stepZ;
+		switch (step.m_stepMode)
+		{
+		case StepMode::Table:
+			stepX = TableStepAvx2(absX, phase, 0);
+			stepY = TableStepAvx2(absY, phase, 1);
+			stepZ = TableStepAvx2(absZ, phase, 2);
+			break;
+		case StepMode::Dda:
+			stepX = DdaStepAvx2(absX, phase);
+			stepY = DdaStepAvx2(absY, phase);
+			stepZ = DdaStepAvx2(absZ, phase);
+			break;
+		default:
+		{
+			__m256i randomX = _mm256_and_si256(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&step.m_randomBytes[0][lane]))), randomMask);
+			__m256i randomY = _mm256_and_si256(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&step.m_randomBytes[1][lane]))), randomMask);
+			__m256i randomZ = _mm256_and_si256(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&step.m_randomBytes[2][lane]))), randomMask);
+			// abs(orient) >= random
+			stepX = _mm256_xor_si256(_mm256_cmpgt_epi32(randomX, absX), allOnes);
+			stepY = _mm256_xor_si256(_mm256_cmpgt_epi32(randomY, absY), allOnes);
+			stepZ = _mm256_xor_si256(_mm256_cmpgt_epi32(randomZ, absZ), allOnes);
+			break;
+		}
+		}
+		// step ? sign(orient) : 0
+		__m256i shiftX = _mm256_and_si256(stepX, _mm256_sign_epi32(one, orientX));
+		__m256i shiftY = _mm256_and_si256(stepY, _mm256_sign_epi32(one, orientY));
+		__m256i shiftZ = _mm256_and_si256(stepZ, _mm256_sign_epi32(one, orientZ));
+		param = _mm256_or_si256(_mm256_andnot_si256(stepPhaseMask, param), _mm256_and_si256(_mm256_add_epi32(param, stepPhaseOne), stepPhaseMask));
+		// GetCellPhotonIndex: x * 9 + y * 3 + z + 13, central cell is skipped
+		__m256i index = _mm256_add_epi32(_mm256_add_epi32(_mm256_add_epi32(_mm256_slli_epi32(shiftX, 3), shiftX),
+			_mm256_add_epi32(_mm256_slli_epi32(shiftY, 1), shiftY)), _mm256_add_epi32(shiftZ, centralIndex));
+		index = _mm256_add_epi32(index, _mm256_cmpgt_epi32(index, centralIndex));
+
+		_mm256_store_si256(reinterpret_cast<__m256i*>(colors.data()), color);
+		_mm256_store_si256(reinterpret_cast<__m256i*>(orients.data()), orient);
+		_mm256_store_si256(reinterpret_cast<__m256i*>(params.data()), param);
+		_mm256_store_si256(reinterpret_cast<__m256i*>(unitX.data()), shiftX);
+		_mm256_store_si256(reinterpret_cast<__m256i*>(unitY.data()), shiftY);
+		_mm256_store_si256(reinterpret_cast<__m256i*>(unitZ.data()), shiftZ);
+		_mm256_store_si256(reinterpret_cast<__m256i*>(indices.data()), index);
+		aliveMask |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(alive)) << lane;
+
+		uint32_t lanesCount = std::min(8u, count - lane);
+		for (uint32_t ii = 0; ii < lanesCount; ++ii)
+		{
+			int32_t *outDwords = reinterpret_cast<int32_t*>(&step.m_outPhotons[lane + ii]);
+			outDwords[0] = colors[ii];
+			outDwords[1] = orients[ii];
+			outDwords[2] = params[ii];
+			step.m_unitVectors[lane + ii] = VectorInt8Math((int8_t)unitX[ii], (int8_t)unitY[ii], (int8_t)unitZ[ii]);
+			step.m_photonIndices[lane + ii] = (uint8_t)indices[ii];
+		}
+	}
+	step.m_photonsCount = count;
+	step.m_aliveMask = aliveMask & (count < 32 ? (1u << count) - 1 : ~0u);
+}
+
+void StepCellPhotonsCompare(CellPhotonsStep &step)
+{
+	CellPhotonsStep scalarStep = step;
+	StepCellPhotonsScalar(scalarStep);
+	StepCellPhotonsAvx2(step);
+
+	bool bEqual = scalarStep.m_photonsCount == step.m_photonsCount && scalarStep.m_aliveMask == step.m_aliveMask;
+	for (uint32_t ii = 0; bEqual && ii < step.m_photonsCount; ++ii)
+	{
+		if (!(step.m_aliveMask & (1 << ii)))
+		{
+			continue; // weakened photon is dropped
+		}
+		const Photon &photon = step.m_outPhotons[ii];
+		const Photon &scalarPhoton = scalarStep.m_outPhotons[ii];
+		bEqual = photon.m_color == scalarPhoton.m_color && !(photon.m_orientation != scalarPhoton.m_orientation) &&
+			photon.m_param == scalarPhoton.m_param && photon.m_param2 == scalarPhoton.m_param2 && photon.m_stepPhase == scalarPhoton.m_stepPhase &&
+			!(step.m_unitVectors[ii] != scalarStep.m_unitVectors[ii]) && step.m_photonIndices[ii] == scalarStep.m_photonIndices[ii];
+	}
+	if (!bEqual)
+	{
+		ReportCompareMismatch("scalar kernel", step.m_photonsMask);
+	}
+}
+
+}
+}
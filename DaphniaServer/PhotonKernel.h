@@ -0,0 +1,66 @@
+#pragma once
+
+#include "PPhHelpers.h"
+#include "array"
+
+namespace PPh
+{
+namespace PhotonKernel
+{
+	enum class KernelType
+	{
+		Auto = 0, // best supported by CPU
+		Scalar,
+		Avx2,
+		Compare // Avx2 results are checked against Scalar
+	};
+
+	// How photon picks shift to next cell. Every axis steps (abs(orientation) + 1) times per STEP_PERIOD steps in all modes
+	enum class StepMode
+	{
+		Random = 0, // axis steps if abs(orientation) >= random byte, needs 3 random bytes per photon step
+		Table, // axis steps by precomputed pattern of its orientation at photon step phase, patterns of axes are nearly independent
+		Dda // Bresenham stepping of all axes at photon step phase, photon follows digital line of its orientation
+	};
+
+	constexpr uint32_t STEP_PERIOD = OrientationVectorMath::PPH_INT_MAX + 1;
+	constexpr uint32_t STEP_PHASE_MASK = STEP_PERIOD - 1;
+
+	constexpr uint32_t MAX_CELL_PHOTONS = 26;
+	constexpr uint32_t BATCH_LANES = 32; // MAX_CELL_PHOTONS rounded up to vector width
+
+	// All photons of one cell for one quantum of time
+	struct CellPhotonsStep
+	{
+		// input
+		const Photon *m_photons = nullptr; // first slot of cell
+		uint32_t m_photonsStride = 1; // distance in Photons between slots, more than 1 if slots of cell are not side by side
+		uint32_t m_photonsMask = 0;
+		bool m_bReflect = false; // cell is crumb, block or observer
+		EtherColor m_cellColor;
+		uint8_t m_weakening = 0;
+		StepMode m_stepMode = StepMode::Random;
+		std::array<std::array<uint8_t, BATCH_LANES>, 3> m_randomBytes; // x, y, z random bytes for every photon, StepMode::Random only
+
+		// output, photons are in order of m_photonsMask bits
+		uint32_t m_photonsCount = 0;
+		uint32_t m_aliveMask = 0; // photons which are not weakened to zero
+		std::array<Photon, MAX_CELL_PHOTONS> m_outPhotons;
+		std::array<VectorInt8Math, MAX_CELL_PHOTONS> m_unitVectors; // shift to next cell
+		std::array<uint8_t, MAX_CELL_PHOTONS> m_photonIndices; // GetCellPhotonIndex(unitVector)
+	};
+
+	bool Init(KernelType type); // returns false if kernel is not supported by CPU, Scalar is used then
+	const char* GetKernelName();
+	uint64_t GetCompareMismatches();
+	bool IsCompareKernel(); // callers could check kernel results against own reference path too
+	void ReportCompareMismatch(const char *reference, uint32_t photonsMask); // counted by GetCompareMismatches
+
+	void StepCellPhotons(CellPhotonsStep &step);
+	VectorInt8Math StepPhoton(StepMode mode, Photon &photon); // single photon outside of cell step, advances step phase
+
+	// Statistical check that mode reproduces shift distribution of StepMode::Random. Prints deviations, returns false if mean shift differs
+	bool CheckStepMode(StepMode mode);
+	const char* GetStepModeName(StepMode mode);
+}
+}
@@ -9,7 +9,7 @@ namespace PPh
 {
 namespace CommonParams // Server - client common params
 {
-	constexpr int32_t PROTOCOL_VERSION = 2;
+	constexpr int32_t PROTOCOL_VERSION = 3;
 	constexpr int32_t DEFAULT_BUFLEN = 512;
 	constexpr uint16_t CLIENT_UDP_PORT_START = 50000;
 	constexpr uint16_t MAX_CLIENTS = 10;
@@ -19,6 +19,8 @@ namespace CommonParams // Server - client common params
 		Daphnia16x16
 	};
 	constexpr uint16_t QUANTUM_OF_TIME_PER_SECOND = 10000; // 0 - infinite
+	constexpr uint16_t MAX_STATISTICS_UNIVERSE_THREADS = 64; // cpus of further universe threads are not reported
+	constexpr uint16_t NOT_PINNED_CPU = 0xFFFF;
 }
 namespace MsgType
 {
@@ -171,8 +173,15 @@ public:
 	uint32_t m_observerThreadTickTime; // in microseconds
 	uint32_t m_universeThreadMaxTickTime; // in microseconds
 	uint32_t m_universeThreadMinTickTime; // in microseconds
+	uint32_t m_observerThreadBarrierWaitTime; // in microseconds per quantum of time, waits at tick barrier
+	uint32_t m_universeThreadMaxBarrierWaitTime; // in microseconds per quantum of time
+	uint32_t m_universeThreadMinBarrierWaitTime; // in microseconds per quantum of time
 	uint64_t m_clientServerPerformanceRatio; // in milli how much client ticks more often than server ticks
 	uint64_t m_serverClientPerformanceRatio; // in milli how much server ticks more often than client ticks
+	uint16_t m_activeUniverseThreadsCount; // universe threads which take part in quantum of time, others are parked
+	uint16_t m_observerThreadCpu; // group * 64 + number of logical processor, NOT_PINNED_CPU if threads are not pinned
+	uint16_t m_universeThreadCpus[CommonParams::MAX_STATISTICS_UNIVERSE_THREADS]; // like m_observerThreadCpu
+	uint64_t m_culledPhotonStepsPerSecond; // photon steps saved by energy horizon culling
 };
 
 class MsgGetStateResponse : public MsgBase